@@ -4,13 +4,12 @@ import android.app.Activity;
 import android.hardware.Camera;
 import android.os.Bundle;
 import android.os.SystemClock;
+import android.util.DisplayMetrics;
 import android.util.Log;
 
 import org.opencv.android.CameraBridgeViewBase;
+import org.opencv.core.CvType;
 import org.opencv.core.Mat;
-import org.opencv.core.Rect;
-import org.opencv.core.Size;
-import org.opencv.imgproc.Imgproc;
 
 import java.util.List;
 import java.util.ListIterator;
@@ -23,12 +22,25 @@ public class MainActivity extends Activity implements CameraBridgeViewBase.CvCam
     private static final String TAG = "MainActivity";
     private static final int ResolutionX = 800;
     private static final int ResolutionY = 480;
+    // Size of the keyboard, markers have ids from 0 to MarkersCount - 1.
+    private static final int KeysCount = 49;
+    private static final int MarkersCount = 17;
+    // Shift of each eye image towards the center of the screen, in pixels.
+    private static final int EyeOffset = 0;
+    // Barrel distortion that compensates the pincushion distortion of the headset lenses, with the
+    // coefficients and the screen to lens distance in millimeters of the Cardboard v1 viewer.
+    private static final float LensK1 = 0.441f;
+    private static final float LensK2 = 0.156f;
+    private static final float ScreenToLens = 42.0f;
 
     private CameraView mCameraView;
 
     private Mat mRgba;
     private Mat mGray;
-    private Mat mHalf;
+    // Side by side image for both eyes, allocated once.
+    private Mat mStereo;
+    // Pixels of the stereo image per millimeter of the screen.
+    private float mPixelsPerMm;
 
     // Load OpenCV and imageproc libraries.
     static {
@@ -45,6 +57,8 @@ public class MainActivity extends Activity implements CameraBridgeViewBase.CvCam
 
         setContentView(R.layout.layout);
 
+        setKeyboardLayout(KeysCount, MarkersCount);
+
         mCameraView = (CameraView) findViewById(R.id.camera_view);
         mCameraView.setCvCameraViewListener(this);
         mCameraView.enableView();
@@ -81,11 +95,25 @@ public class MainActivity extends Activity implements CameraBridgeViewBase.CvCam
                 break;
             }
         }
+
+        mStereo = new Mat(height, width, CvType.CV_8UC4);
+
+        // The camera view scales the frame to fit the screen, keeping its aspect ratio.
+        DisplayMetrics metrics = new DisplayMetrics();
+        getWindowManager().getDefaultDisplay().getRealMetrics(metrics);
+        float scale = Math.min((float) metrics.widthPixels / width, (float) metrics.heightPixels / height);
+        mPixelsPerMm = metrics.xdpi / 25.4f * scale;
+
+        // Markers are detected on a native thread, camera frames only wait for the drawing.
+        startPipeline();
     }
 
     @Override
     public void onCameraViewStopped() {
+        stopPipeline();
+
         mRgba.release();
+        mStereo.release();
     }
 
     @Override
@@ -93,22 +121,26 @@ public class MainActivity extends Activity implements CameraBridgeViewBase.CvCam
         mRgba = inputFrame.rgba();
         mGray = inputFrame.gray();
 
-        detectMarkersAndDraw(mGray.getNativeObjAddr(), mRgba.getNativeObjAddr());
-
-        mHalf = mRgba.clone();
-
-        try {
-            Imgproc.resize(mHalf, mHalf, new Size(mHalf.cols() / 2, mHalf.rows()), 0, 0, Imgproc.INTER_LINEAR);
-            mHalf.copyTo(mRgba.submat(new Rect(0, 0, mHalf.cols(), mHalf.rows())));
-            mHalf.copyTo(mRgba.submat(new Rect(mHalf.cols(), 0, mHalf.cols(), mHalf.rows())));
-        } catch (Exception e) {
-            Log.e(TAG, e.getMessage());
-        }
+        // Queue the frame for detection and draw the latest detected markers.
+        processFrame(mGray.getNativeObjAddr(), mRgba.getNativeObjAddr());
 
-        mHalf.release();
+        // Downsample and distort the frame to both halves of the stereo image in one pass.
+        composeStereo(mRgba.getNativeObjAddr(), mStereo.getNativeObjAddr(), EyeOffset, LensK1, LensK2,
+                ScreenToLens, mPixelsPerMm);
 
-        return mRgba;
+        return mStereo;
     }
 
+    public native void setKeyboardLayout(int keysCount, int markersCount);
+
     public native void detectMarkersAndDraw(long matAddrGr, long matAddrRgba);
+
+    public native void startPipeline();
+
+    public native void stopPipeline();
+
+    public native void processFrame(long matAddrGr, long matAddrRgba);
+
+    public native void composeStereo(long matAddrRgba, long matAddrStereo, int eyeOffset, float k1, float k2,
+                                     float screenToLens, float pixelsPerMm);
 }
\ No newline at end of file
@@ -38,8 +38,10 @@ the use of this software, even if advised of the possibility of such damage.
 
 #include "precomp.hpp"
 #include "aruco.hpp"
+#include "marker_kernels.hpp"
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/core/hal/hal.hpp>
 
 
 namespace cv {
@@ -65,6 +67,8 @@ DetectorParameters::DetectorParameters()
       minDistanceToBorder(3),
       minMarkerDistanceRate(0.05),
       doCornerRefinement(false),
+      cornerRefinementMethod(CORNER_REFINE_SUBPIX),
+      cornerRefinementContourEdgeSampling(true),
       cornerRefinementWinSize(5),
       cornerRefinementMaxIterations(30),
       cornerRefinementMinAccuracy(0.1),
@@ -85,6 +89,145 @@ Ptr<DetectorParameters> DetectorParameters::create() {
 }
 
 
+/**
+  *
+  */
+IdentificationCache::IdentificationCache(int capacity, float positionTolerance,
+                                         float sizeTolerance)
+    : _capacity(capacity), _positionTolerance(positionTolerance), _sizeTolerance(sizeTolerance),
+      _frame(0), _lookups(0), _hits(0), _invalidations(0) {
+
+    CV_Assert(capacity > 0 && positionTolerance > 0 && sizeTolerance > 0);
+    entries.reserve((size_t)capacity);
+}
+
+
+/**
+  * @brief Create a new identification cache
+  */
+Ptr<IdentificationCache> IdentificationCache::create(int capacity, float positionTolerance,
+                                                     float sizeTolerance) {
+    return makePtr<IdentificationCache>(capacity, positionTolerance, sizeTolerance);
+}
+
+
+/**
+  *
+  */
+void IdentificationCache::nextFrame() {
+    _frame++;
+}
+
+
+/**
+  *
+  */
+int IdentificationCache::find(Point2f center, float size) const {
+
+    for(unsigned int i = 0; i < entries.size(); i++) {
+        const Entry &e = entries[i];
+        if(!e.valid) continue;
+
+        float maxDistance = _positionTolerance * e.size;
+        Point2f diff = center - e.center;
+        if(diff.x * diff.x + diff.y * diff.y > maxDistance * maxDistance) continue;
+        if(fabs(size - e.size) > _sizeTolerance * e.size) continue;
+        return (int)i;
+    }
+    return -1;
+}
+
+
+/**
+  *
+  */
+void IdentificationCache::insert(Point2f center, float size, int id, int rotation) {
+
+    int entryIdx = find(center, size);
+
+    // if not in the same position than a previous marker, take a free entry
+    if(entryIdx < 0) {
+        for(unsigned int i = 0; i < entries.size(); i++) {
+            if(!entries[i].valid) {
+                entryIdx = (int)i;
+                break;
+            }
+        }
+    }
+
+    // if there is no free entry, add a new one or replace the least recently seen one
+    if(entryIdx < 0) {
+        if((int)entries.size() < _capacity) {
+            entries.push_back(Entry());
+            entryIdx = (int)entries.size() - 1;
+        } else {
+            entryIdx = 0;
+            for(unsigned int i = 1; i < entries.size(); i++) {
+                if(entries[i].lastFrame < entries[entryIdx].lastFrame) entryIdx = (int)i;
+            }
+        }
+    }
+
+    Entry &e = entries[entryIdx];
+    e.center = center;
+    e.size = size;
+    e.id = id;
+    e.rotation = rotation;
+    e.lastFrame = _frame;
+    e.valid = true;
+}
+
+
+/**
+  *
+  */
+void IdentificationCache::update(int entryIdx, Point2f center, float size, int rotation) {
+
+    CV_Assert(entryIdx >= 0 && entryIdx < (int)entries.size());
+    Entry &e = entries[entryIdx];
+    e.center = center;
+    e.size = size;
+    e.rotation = rotation;
+    e.lastFrame = _frame;
+}
+
+
+/**
+  *
+  */
+void IdentificationCache::invalidate(int entryIdx) {
+
+    CV_Assert(entryIdx >= 0 && entryIdx < (int)entries.size());
+    entries[entryIdx].valid = false;
+}
+
+
+/**
+  *
+  */
+void IdentificationCache::clear() {
+    entries.clear();
+}
+
+
+/**
+  *
+  */
+void IdentificationCache::addStats(int lookups, int hits, int invalidations) {
+    _lookups += lookups;
+    _hits += hits;
+    _invalidations += invalidations;
+}
+
+
+/**
+  *
+  */
+void IdentificationCache::resetStats() {
+    _lookups = _hits = _invalidations = 0;
+}
+
+
 /**
   * @brief Convert input image to gray if it is a 3-channels image
   */
@@ -398,13 +541,49 @@ static void _detectCandidates(InputArray _image, OutputArrayOfArrays _candidates
 }
 
 
+/**
+  * @brief Otsu threshold of an 8 bits histogram. Equivalent to the value used by threshold() with
+  * THRESH_OTSU, pixels higher than the returned value are considered white
+  */
+static int _getOtsuThreshold(const int *hist, int total) {
+
+    double mu = 0, scale = 1. / total;
+    for(int i = 0; i < 256; i++)
+        mu += i * (double)hist[i];
+    mu *= scale;
+
+    double mu1 = 0, q1 = 0;
+    double maxSigma = 0;
+    int maxVal = 0;
+    for(int i = 0; i < 256; i++) {
+        double p_i = hist[i] * scale;
+        mu1 *= q1;
+        q1 += p_i;
+        double q2 = 1. - q1;
+
+        if(min(q1, q2) < FLT_EPSILON || max(q1, q2) > 1. - FLT_EPSILON) continue;
+
+        mu1 = (mu1 + i * p_i) / q1;
+        double mu2 = (mu - q1 * mu1) / q2;
+        double sigma = q1 * q2 * (mu1 - mu2) * (mu1 - mu2);
+        if(sigma > maxSigma) {
+            maxSigma = sigma;
+            maxVal = i;
+        }
+    }
+    return maxVal;
+}
+
+
 /**
   * @brief Given an input image and candidate corners, extract the bits of the candidate, including
-  * the border bits
+  * the border bits. Returns false, without extracting the inner bits, as soon as the border has
+  * more than maxBorderErrors erroneous bits
   */
-static Mat _extractBits(InputArray _image, InputArray _corners, int markerSize,
-                        int markerBorderBits, int cellSize, double cellMarginRate,
-                        double minStdDevOtsu) {
+static bool _extractBits(InputArray _image, InputArray _corners, const MarkerKernels &kernels,
+                         int markerSize, int markerBorderBits, int cellSize,
+                         double cellMarginRate, double minStdDevOtsu, int maxBorderErrors,
+                         Mat &bits) {
 
     CV_Assert(_image.getMat().channels() == 1);
     CV_Assert(_corners.total() == 4);
@@ -430,45 +609,66 @@ static Mat _extractBits(InputArray _image, InputArray _corners, int markerSize,
                     INTER_NEAREST);
 
     // output image containing the bits
-    Mat bits(markerSizeWithBorders, markerSizeWithBorders, CV_8UC1, Scalar::all(0));
+    bits.create(markerSizeWithBorders, markerSizeWithBorders, CV_8UC1);
+    bits.setTo(Scalar::all(0));
+
+    // histogram of the whole image for Otsu and statistics of the inner region in the same pass.
+    // Remove some border from the inner region just to avoid border noise from perspective
+    // transformation
+    int hist[256] = { 0 };
+    int64 innerSum = 0, innerSqSum = 0;
+    int innerMargin = cellSize / 2;
+    for(int y = 0; y < resultImgSize; y++) {
+        const uchar *row = resultImg.ptr< uchar >(y);
+        for(int x = 0; x < resultImgSize; x++)
+            hist[row[x]]++;
+        if(y < innerMargin || y >= resultImgSize - innerMargin) continue;
+        for(int x = innerMargin; x < resultImgSize - innerMargin; x++) {
+            innerSum += row[x];
+            innerSqSum += row[x] * row[x];
+        }
+    }
 
     // check if standard deviation is enough to apply Otsu
     // if not enough, it probably means all bits are the same color (black or white)
-    Mat mean, stddev;
-    // Remove some border just to avoid border noise from perspective transformation
-    Mat innerRegion = resultImg.colRange(cellSize / 2, resultImg.cols - cellSize / 2)
-                          .rowRange(cellSize / 2, resultImg.rows - cellSize / 2);
-    meanStdDev(innerRegion, mean, stddev);
-    if(stddev.ptr< double >(0)[0] < minStdDevOtsu) {
+    int innerSide = resultImgSize - 2 * innerMargin;
+    double innerTotal = (double)innerSide * innerSide;
+    double mean = innerSum / innerTotal;
+    double stddev = sqrt(max(innerSqSum / innerTotal - mean * mean, 0.));
+    if(stddev < minStdDevOtsu) {
         // all black or all white, depending on mean value
-        if(mean.ptr< double >(0)[0] > 127)
-            bits.setTo(1);
-        else
-            bits.setTo(0);
-        return bits;
+        if(mean > 127) bits.setTo(1);
+        return kernels.borderErrors(bits, markerSize, markerBorderBits) <= maxBorderErrors;
     }
 
-    // now extract code, first threshold using Otsu
-    threshold(resultImg, resultImg, 125, 255, THRESH_BINARY | THRESH_OTSU);
+    // Otsu threshold is applied while counting the pixels of each cell, without binarizing the
+    // image. Border cells first, the inner code is only extracted if the border is valid
+    int otsu = _getOtsuThreshold(hist, resultImgSize * resultImgSize);
+    int borderErrors = kernels.borderCellBits(resultImg, markerSize, markerBorderBits, cellSize,
+                                              cellMarginPixels, otsu, maxBorderErrors, bits);
+    if(borderErrors > maxBorderErrors) return false;
 
-    // for each cell
-    for(int y = 0; y < markerSizeWithBorders; y++) {
-        for(int x = 0; x < markerSizeWithBorders; x++) {
-            int Xstart = x * (cellSize) + cellMarginPixels;
-            int Ystart = y * (cellSize) + cellMarginPixels;
-            Mat square = resultImg(Rect(Xstart, Ystart, cellSize - 2 * cellMarginPixels,
-                                        cellSize - 2 * cellMarginPixels));
-            // count white pixels on each cell to assign its value
-            size_t nZ = (size_t) countNonZero(square);
-            if(nZ > square.total() / 2) bits.at< unsigned char >(y, x) = 1;
-        }
-    }
+    kernels.innerCellBits(resultImg, markerSize, markerBorderBits, cellSize, cellMarginPixels,
+                          otsu, bits);
+    return true;
+}
+
+
+/**
+  * @brief Given an input image and candidate corners, extract the bits of the candidate,
+  * including the border bits
+  */
+static Mat _extractBits(InputArray _image, InputArray _corners, int markerSize,
+                        int markerBorderBits, int cellSize, double cellMarginRate,
+                        double minStdDevOtsu) {
 
+    Mat bits;
+    _extractBits(_image, _corners, getMarkerKernels(markerSize, markerBorderBits), markerSize,
+                 markerBorderBits, cellSize, cellMarginRate, minStdDevOtsu, INT_MAX, bits);
     return bits;
 }
 
 
-
 /**
   * @brief Return number of erroneous bits in border, i.e. number of white bits in border.
   */
@@ -478,45 +678,381 @@ static int _getBorderErrors(const Mat &bits, int markerSize, int borderSize) {
 
     CV_Assert(markerSize > 0 && bits.cols == sizeWithBorders && bits.rows == sizeWithBorders);
 
-    int totalErrors = 0;
-    for(int y = 0; y < sizeWithBorders; y++) {
-        for(int k = 0; k < borderSize; k++) {
-            if(bits.ptr< unsigned char >(y)[k] != 0) totalErrors++;
-            if(bits.ptr< unsigned char >(y)[sizeWithBorders - 1 - k] != 0) totalErrors++;
+    return getMarkerKernels(markerSize, borderSize).borderErrors(bits, markerSize, borderSize);
+}
+
+
+/**
+  * @brief Center and mean side length of a candidate
+  */
+static void _getCandidateCenterAndSize(const Mat &corners, Point2f &center, float &size) {
+
+    const Point2f *c = corners.ptr< Point2f >(0);
+    center = (c[0] + c[1] + c[2] + c[3]) * 0.25f;
+    size = 0;
+    for(int j = 0; j < 4; j++) {
+        Point2f side = c[(j + 1) % 4] - c[j];
+        size += sqrt(side.x * side.x + side.y * side.y);
+    }
+    size /= 4.f;
+}
+
+
+/**
+  * @brief Closed form projective transformation from the unit square to a quad, so that
+  * (0,0), (1,0), (1,1) and (0,1) are mapped to the four corners in order.
+  * A point (u,v) is mapped to ((h0*u + h1*v + h2) / w, (h3*u + h4*v + h5) / w), with
+  * w = h6*u + h7*v + 1. Returns false if the quad is degenerated.
+  */
+static bool _getSquareToQuadTransform(const Point2f *corners, double *h) {
+
+    double x0 = corners[0].x, y0 = corners[0].y;
+    double x1 = corners[1].x, y1 = corners[1].y;
+    double x2 = corners[2].x, y2 = corners[2].y;
+    double x3 = corners[3].x, y3 = corners[3].y;
+
+    double sx = x0 - x1 + x2 - x3;
+    double sy = y0 - y1 + y2 - y3;
+    double dx1 = x1 - x2, dx2 = x3 - x2;
+    double dy1 = y1 - y2, dy2 = y3 - y2;
+    double den = dx1 * dy2 - dx2 * dy1;
+    if(fabs(den) < DBL_EPSILON) return false;
+
+    double g = (sx * dy2 - dx2 * sy) / den;
+    double k = (dx1 * sy - sx * dy1) / den;
+
+    h[0] = x1 - x0 + g * x1;
+    h[1] = x3 - x0 + k * x3;
+    h[2] = x0;
+    h[3] = y1 - y0 + g * y1;
+    h[4] = y3 - y0 + k * y3;
+    h[5] = y0;
+    h[6] = g;
+    h[7] = k;
+    return true;
+}
+
+
+/**
+  * @brief Shift candidate corner positions to the rotation returned by the dictionary
+  */
+static void _rotateCandidateCorners(InputOutputArray _corners, int rotation) {
+
+    if(rotation == 0) return;
+    Mat corners = _corners.getMat();
+    Point2f copyPoints[4];
+    for(int j = 0; j < 4; j++)
+        copyPoints[j] = corners.ptr< Point2f >(0)[j];
+    for(int j = 0; j < 4; j++)
+        corners.ptr< Point2f >(0)[j] = copyPoints[(j + 4 - rotation) % 4];
+}
+
+
+/**
+  * @brief Bilinear interpolation of a grey image, with replicated border
+  */
+static inline float _sampleGrey(const Mat &grey, float x, float y) {
+
+    x = min(max(x, 0.f), (float)grey.cols - 1.f);
+    y = min(max(y, 0.f), (float)grey.rows - 1.f);
+    int x0 = min(cvFloor(x), grey.cols - 2), y0 = min(cvFloor(y), grey.rows - 2);
+    x0 = max(x0, 0);
+    y0 = max(y0, 0);
+    int x1 = min(x0 + 1, grey.cols - 1), y1 = min(y0 + 1, grey.rows - 1);
+    float a = x - x0, b = y - y0;
+    const uchar *r0 = grey.ptr< uchar >(y0), *r1 = grey.ptr< uchar >(y1);
+    return (1.f - b) * ((1.f - a) * r0[x0] + a * r0[x1]) + b * ((1.f - a) * r1[x0] + a * r1[x1]);
+}
+
+
+/**
+  * @brief Total least squares line fitting. The line is returned as a point and a unit direction
+  */
+static bool _fitEdgeLine(const vector< Point2f > &points, Point2f &point, Point2f &direction) {
+
+    if(points.size() < 2) return false;
+
+    Point2f mean(0, 0);
+    for(unsigned int i = 0; i < points.size(); i++)
+        mean += points[i];
+    mean = mean * (1.f / points.size());
+
+    double sxx = 0, sxy = 0, syy = 0;
+    for(unsigned int i = 0; i < points.size(); i++) {
+        double dx = points[i].x - mean.x, dy = points[i].y - mean.y;
+        sxx += dx * dx;
+        sxy += dx * dy;
+        syy += dy * dy;
+    }
+    if(sxx + syy < FLT_EPSILON) return false;
+
+    // principal direction of the covariance matrix
+    double angle = 0.5 * atan2(2. * sxy, sxx - syy);
+    point = mean;
+    direction = Point2f((float)cos(angle), (float)sin(angle));
+    return true;
+}
+
+
+/**
+  * @brief Move the points of an edge to the position of maximum grey level gradient along the
+  * normal of the edge, with subpixel accuracy from a parabola fitting
+  */
+static void _snapEdgePointsToGradient(const Mat &grey, const Point2f &normal,
+                                      vector< Point2f > &points) {
+
+    const int SEARCH_RADIUS = 2;
+
+    for(unsigned int i = 0; i < points.size(); i++) {
+        float values[2 * SEARCH_RADIUS + 3];
+        for(int t = -SEARCH_RADIUS - 1; t <= SEARCH_RADIUS + 1; t++)
+            values[t + SEARCH_RADIUS + 1] =
+                _sampleGrey(grey, points[i].x + t * normal.x, points[i].y + t * normal.y);
+
+        // central differences, the sign of the edge is not known
+        float gradients[2 * SEARCH_RADIUS + 1];
+        int best = 0;
+        for(int t = 0; t < 2 * SEARCH_RADIUS + 1; t++) {
+            gradients[t] = fabs(values[t + 2] - values[t]);
+            if(gradients[t] > gradients[best]) best = t;
+        }
+        if(best == 0 || best == 2 * SEARCH_RADIUS) continue; // no peak inside the search range
+
+        float left = gradients[best - 1], center = gradients[best], right = gradients[best + 1];
+        float den = left - 2.f * center + right;
+        float offset = fabs(den) > FLT_EPSILON ? 0.5f * (left - right) / den : 0.f;
+        float shift = best - SEARCH_RADIUS + offset;
+        points[i] += normal * shift;
+    }
+}
+
+
+/**
+  * @brief Refine the corners of a candidate intersecting the lines fitted to the four edges of
+  * its contour. The contour points of each edge are the ones between the contour points closest
+  * to its two corners, discarding the ones close to the corners, which are usually rounded.
+  * Corners are left unchanged if any of the edges can not be fitted.
+  */
+static void _refineCornersFromContour(const Mat &grey, const Mat &contour, Mat &corners,
+                                      bool edgeSampling) {
+
+    const float CORNER_MARGIN_RATE = 0.1f;
+
+    int npoints = (int)contour.total();
+    const Point *contourPoints = contour.ptr< Point >(0);
+    Point2f *c = corners.ptr< Point2f >(0);
+    if(npoints < 8) return;
+
+    // contour index of each corner
+    int cornerIdx[4];
+    for(int k = 0; k < 4; k++) {
+        float minDistSq = FLT_MAX;
+        for(int p = 0; p < npoints; p++) {
+            float dx = contourPoints[p].x - c[k].x, dy = contourPoints[p].y - c[k].y;
+            if(dx * dx + dy * dy < minDistSq) {
+                minDistSq = dx * dx + dy * dy;
+                cornerIdx[k] = p;
+            }
+        }
+    }
+
+    // corners sorted along the contour
+    int order[4] = { 0, 1, 2, 3 };
+    for(int a = 1; a < 4; a++)
+        for(int b = a; b > 0 && cornerIdx[order[b]] < cornerIdx[order[b - 1]]; b--)
+            swap(order[b], order[b - 1]);
+
+    // edge e goes from corner order[e] to corner order[e + 1]
+    Point2f linePoints[4], lineDirections[4];
+    vector< Point2f > edgePoints;
+    for(int e = 0; e < 4; e++) {
+        int first = cornerIdx[order[e]];
+        int last = cornerIdx[order[(e + 1) % 4]];
+        int length = (last - first + npoints) % npoints;
+        int margin = max(1, int(length * CORNER_MARGIN_RATE));
+        if(length - 2 * margin < 2) return;
+
+        edgePoints.clear();
+        for(int p = margin; p <= length - margin; p++) {
+            const Point &pt = contourPoints[(first + p) % npoints];
+            edgePoints.push_back(Point2f((float)pt.x, (float)pt.y));
+        }
+        if(!_fitEdgeLine(edgePoints, linePoints[e], lineDirections[e])) return;
+
+        if(edgeSampling) {
+            Point2f normal(-lineDirections[e].y, lineDirections[e].x);
+            _snapEdgePointsToGradient(grey, normal, edgePoints);
+            if(!_fitEdgeLine(edgePoints, linePoints[e], lineDirections[e])) return;
         }
     }
-    for(int x = borderSize; x < sizeWithBorders - borderSize; x++) {
-        for(int k = 0; k < borderSize; k++) {
-            if(bits.ptr< unsigned char >(k)[x] != 0) totalErrors++;
-            if(bits.ptr< unsigned char >(sizeWithBorders - 1 - k)[x] != 0) totalErrors++;
+
+    // corner order[e] is the intersection of edges e - 1 and e
+    Point2f refined[4];
+    for(int e = 0; e < 4; e++) {
+        int prev = (e + 3) % 4;
+        const Point2f &p1 = linePoints[prev], &d1 = lineDirections[prev];
+        const Point2f &p2 = linePoints[e], &d2 = lineDirections[e];
+        float den = d1.x * d2.y - d1.y * d2.x;
+        if(fabs(den) < 1e-3f) return; // almost parallel
+        Point2f diff = p2 - p1;
+        float t = (diff.x * d2.y - diff.y * d2.x) / den;
+        refined[order[e]] = p1 + d1 * t;
+    }
+
+    // discard the result if any corner moves more than the margin of its edges
+    float maxShift = max(2.f, npoints * CORNER_MARGIN_RATE / 4.f);
+    for(int k = 0; k < 4; k++) {
+        Point2f shift = refined[k] - c[k];
+        if(shift.x * shift.x + shift.y * shift.y > maxShift * maxShift) return;
+    }
+    for(int k = 0; k < 4; k++)
+        c[k] = refined[k];
+}
+
+
+/**
+  * @brief Ids compared with the candidates, the ids allowed both by the dictionary and by
+  * DetectorParameters::allowedIds, in increasing order
+  *
+  * A parameters list already sorted, without repetitions and allowed by the dictionary, the usual
+  * case, is used in place, so nothing is allocated on each frame. Other lists are filtered into a
+  * copy, with the same result than Dictionary::createView.
+  */
+struct AllowedIds {
+    const int *ids; // null for all the markers in bytesList
+    int nIds;
+    vector< int > filtered;
+
+    AllowedIds(const Dictionary &dictionary, const vector< int > &paramIds) {
+
+        const vector< int > &dictionaryIds = dictionary.allowedIds;
+        if(paramIds.empty()) {
+            ids = dictionaryIds.empty() ? 0 : &dictionaryIds[0];
+            nIds = (int)dictionaryIds.size();
+            return;
+        }
+
+        bool inPlace = true;
+        for(size_t i = 0; i < paramIds.size() && inPlace; i++)
+            inPlace = dictionary.isAllowedId(paramIds[i]) &&
+                      (i == 0 || paramIds[i - 1] < paramIds[i]);
+        if(inPlace) {
+            ids = &paramIds[0];
+            nIds = (int)paramIds.size();
+            return;
+        }
+
+        filtered.reserve(paramIds.size() + 1);
+        for(size_t i = 0; i < paramIds.size(); i++)
+            if(dictionary.isAllowedId(paramIds[i])) filtered.push_back(paramIds[i]);
+        sort(filtered.begin(), filtered.end());
+        filtered.erase(unique(filtered.begin(), filtered.end()), filtered.end());
+        nIds = (int)filtered.size();
+        // ids must not be null when no id is allowed
+        filtered.push_back(-1);
+        ids = &filtered[0];
+    }
+
+    bool contains(const Dictionary &dictionary, int id) const {
+        if(!ids) return id >= 0 && id < dictionary.bytesList.rows;
+        return binary_search(ids, ids + nIds, id);
+    }
+};
+
+
+/**
+  * @brief Check if a candidate is still the marker id stored in the identification cache by
+  * sampling only the center pixel of each cell. The code is only compared with the cached
+  * rotation of the marker, a different rotation (the corner order of the candidate changed) fails
+  * the verification and the candidate follows the complete identification.
+  */
+static bool _verifyCachedCandidate(const Mat &grey, const Mat &corners,
+                                   const Ptr<Dictionary> &dictionary, const MarkerKernels &kernels,
+                                   const AllowedIds &allowed, int id, int rotation,
+                                   const Ptr<DetectorParameters> &params) {
+
+    if(!allowed.contains(*dictionary, id)) return false;
+
+    int markerSize = dictionary->markerSize;
+    int borderSize = params->markerBorderBits;
+    int sizeWithBorders = markerSize + 2 * borderSize;
+
+    double h[8];
+    if(!_getSquareToQuadTransform(corners.ptr< Point2f >(0), h)) return false;
+
+    // sample the center of each cell
+    Mat bits(sizeWithBorders, sizeWithBorders, CV_8UC1);
+    int hist[256] = { 0 };
+    double sum = 0, sqSum = 0;
+    for(int y = 0; y < sizeWithBorders; y++) {
+        double v = (y + 0.5) / sizeWithBorders;
+        for(int x = 0; x < sizeWithBorders; x++) {
+            double u = (x + 0.5) / sizeWithBorders;
+            double w = h[6] * u + h[7] * v + 1.;
+            int px = cvRound((h[0] * u + h[1] * v + h[2]) / w);
+            int py = cvRound((h[3] * u + h[4] * v + h[5]) / w);
+            px = min(max(px, 0), grey.cols - 1);
+            py = min(max(py, 0), grey.rows - 1);
+
+            uchar value = grey.ptr< uchar >(py)[px];
+            bits.ptr< uchar >(y)[x] = value;
+            hist[value]++;
+            sum += value;
+            sqSum += (double)value * value;
         }
     }
-    return totalErrors;
+
+    // not enough contrast to decide, use the complete identification
+    int total = sizeWithBorders * sizeWithBorders;
+    double mean = sum / total;
+    double stddev = sqrt(max(sqSum / total - mean * mean, 0.));
+    if(stddev < params->minOtsuStdDev) return false;
+
+    int otsu = _getOtsuThreshold(hist, total);
+    for(int y = 0; y < sizeWithBorders; y++) {
+        uchar *row = bits.ptr< uchar >(y);
+        for(int x = 0; x < sizeWithBorders; x++)
+            row[x] = row[x] > otsu ? 1 : 0;
+    }
+
+    int maximumErrorsInBorder = int(markerSize * markerSize * params->maxErroneousBitsInBorderRate);
+    if(_getBorderErrors(bits, markerSize, borderSize) > maximumErrorsInBorder) return false;
+
+    Mat onlyBits = bits.rowRange(borderSize, bits.rows - borderSize)
+                       .colRange(borderSize, bits.cols - borderSize);
+    int nbytes = (markerSize * markerSize + 8 - 1) / 8;
+    AutoBuffer< uchar > candidateBytes((size_t)nbytes);
+    kernels.packBits(onlyBits, markerSize, candidateBytes);
+    int maxCorrectionRecalculed =
+        int(double(dictionary->maxCorrectionBits) * params->errorCorrectionRate);
+    return cv::hal::normHamming(dictionary->bytesList.ptr(id) + rotation * nbytes, candidateBytes,
+                                nbytes) <= maxCorrectionRecalculed;
 }
 
 
 /**
- * @brief Tries to identify one candidate given the dictionary
+ * @brief Tries to identify one candidate given the dictionary and its specialized kernels
  */
-static bool _identifyOneCandidate(Ptr<Dictionary> &dictionary, InputArray _image,
-                                  InputOutputArray _corners, int &idx, const Ptr<DetectorParameters> &params) {
+static bool _identifyOneCandidate(Ptr<Dictionary> &dictionary, const MarkerKernels &kernels,
+                                  const AllowedIds &allowed,
+                                  InputArray _image, InputOutputArray _corners, int &idx,
+                                  int &rotation, const Ptr<DetectorParameters> &params) {
 
     CV_Assert(_corners.total() == 4);
     CV_Assert(_image.getMat().total() != 0);
     CV_Assert(params->markerBorderBits > 0);
 
-    // get bits
-    Mat candidateBits =
-        _extractBits(_image, _corners, dictionary->markerSize, params->markerBorderBits,
-                     params->perspectiveRemovePixelPerCell,
-                     params->perspectiveRemoveIgnoredMarginPerCell, params->minOtsuStdDev);
+    int markerSize = dictionary->markerSize;
 
-    // analyze border bits
+    // get bits, the extraction stops as soon as the border has too many errors
     int maximumErrorsInBorder =
-        int(dictionary->markerSize * dictionary->markerSize * params->maxErroneousBitsInBorderRate);
-    int borderErrors =
-        _getBorderErrors(candidateBits, dictionary->markerSize, params->markerBorderBits);
-    if(borderErrors > maximumErrorsInBorder) return false; // border is wrong
+        int(markerSize * markerSize * params->maxErroneousBitsInBorderRate);
+    Mat candidateBits;
+    if(!_extractBits(_image, _corners, kernels, markerSize, params->markerBorderBits,
+                     params->perspectiveRemovePixelPerCell,
+                     params->perspectiveRemoveIgnoredMarginPerCell, params->minOtsuStdDev,
+                     maximumErrorsInBorder, candidateBits))
+        return false; // border is wrong
 
     // take only inner bits
     Mat onlyBits =
@@ -525,22 +1061,91 @@ static bool _identifyOneCandidate(Ptr<Dictionary> &dictionary, InputArray _image
             .colRange(params->markerBorderBits, candidateBits.rows - params->markerBorderBits);
 
     // try to indentify the marker
-    int rotation;
-    if(!dictionary->identify(onlyBits, idx, rotation, params->errorCorrectionRate))
+    AutoBuffer< uchar > candidateBytes((size_t)(markerSize * markerSize + 8 - 1) / 8);
+    kernels.packBits(onlyBits, markerSize, candidateBytes);
+    int maxCorrectionRecalculed =
+        int(double(dictionary->maxCorrectionBits) * params->errorCorrectionRate);
+    if(!kernels.identify(dictionary->bytesList, allowed.ids, allowed.nIds, candidateBytes,
+                         markerSize, maxCorrectionRecalculed, idx, rotation))
         return false;
     else {
         // shift corner positions to the correct rotation
-        if(rotation != 0) {
-            Mat copyPoints = _corners.getMat().clone();
-            for(int j = 0; j < 4; j++)
-                _corners.getMat().ptr< Point2f >(0)[j] =
-                    copyPoints.ptr< Point2f >(0)[(j + 4 - rotation) % 4];
-        }
+        _rotateCandidateCorners(_corners, rotation);
         return true;
     }
 }
 
 
+/**
+  * @brief Results of the identification of a contiguous range of candidates. Each chunk is
+  * processed by a single thread, so no synchronization is needed
+  */
+struct IdentificationChunk {
+    int begin, end;            // range of candidates
+    vector< int > accepted;    // indexes of the identified candidates, in order
+    vector< int > ids;         // marker id of each accepted candidate
+    vector< int > rotations;   // rotation of each accepted candidate
+    vector< int > cacheEntries; // cache entry found for each candidate of the range, or -1
+    vector< char > cacheHits;  // 1 if the candidate was verified against its cache entry
+};
+
+
+/**
+  * @brief Estimated cost of identifying a candidate. The warped image has always the same size,
+  * but bigger candidates touch more rows of the source image, so the perimeter is added to the
+  * fixed cost
+  */
+static int _getCandidateCost(const Mat &candidate, int warpedPixels) {
+
+    const Point2f *c = candidate.ptr< Point2f >(0);
+    float perimeter = 0;
+    for(int j = 0; j < 4; j++) {
+        Point2f side = c[(j + 1) % 4] - c[j];
+        perimeter += sqrt(side.x * side.x + side.y * side.y);
+    }
+    return warpedPixels + cvRound(perimeter);
+}
+
+
+/**
+  * @brief Split the candidates in contiguous chunks with a similar total cost. Several chunks are
+  * created per thread so that the parallel backend can balance the remaining imbalance
+  */
+static void _partitionCandidates(InputArrayOfArrays _candidates, int warpedPixels,
+                                 vector< IdentificationChunk > &chunks) {
+
+    const int CHUNKS_PER_THREAD = 4;
+
+    int ncandidates = (int)_candidates.total();
+    int nchunks = min(ncandidates, max(1, getNumThreads()) * CHUNKS_PER_THREAD);
+    chunks.resize(nchunks);
+    if(nchunks == 0) return;
+
+    // prefix sum of costs
+    vector< int64 > costPrefix(ncandidates + 1, 0);
+    for(int i = 0; i < ncandidates; i++)
+        costPrefix[i + 1] =
+            costPrefix[i] + _getCandidateCost(_candidates.getMat(i), warpedPixels);
+
+    // each chunk ends at the first candidate whose cost prefix reaches its share of the total
+    int begin = 0;
+    for(int c = 0; c < nchunks; c++) {
+        int end = ncandidates;
+        if(c < nchunks - 1) {
+            int64 target = costPrefix[ncandidates] * (c + 1) / nchunks;
+            end = (int)(upper_bound(costPrefix.begin() + begin + 1, costPrefix.end(), target) -
+                        costPrefix.begin()) - 1;
+            // at least one candidate per chunk, and leave one for each of the remaining chunks
+            end = max(end, begin + 1);
+            end = min(end, ncandidates - (nchunks - 1 - c));
+        }
+        chunks[c].begin = begin;
+        chunks[c].end = end;
+        begin = end;
+    }
+}
+
+
 /**
   * ParallelLoopBody class for the parallelization of the marker identification step
   * Called from function _identifyCandidates()
@@ -549,38 +1154,139 @@ class IdentifyCandidatesParallel : public ParallelLoopBody {
     public:
     IdentifyCandidatesParallel(const Mat *_grey, InputArrayOfArrays _candidates,
                                InputArrayOfArrays _contours, Ptr<Dictionary> &_dictionary,
-                               vector< int > *_idsTmp, vector< char > *_validCandidates,
+                               const MarkerKernels *_kernels, const AllowedIds *_allowed,
+                               vector< IdentificationChunk > *_chunks,
+                               const Ptr<IdentificationCache> &_cache,
                                const Ptr<DetectorParameters> &_params)
         : grey(_grey), candidates(_candidates), contours(_contours), dictionary(_dictionary),
-          idsTmp(_idsTmp), validCandidates(_validCandidates), params(_params) {}
+          kernels(_kernels), allowed(_allowed), chunks(_chunks), cache(_cache), params(_params) {}
 
     void operator()(const Range &range) const {
         const int begin = range.start;
         const int end = range.end;
 
-        for(int i = begin; i < end; i++) {
-            int currId;
-            Mat currentCandidate = candidates.getMat(i);
-            if(_identifyOneCandidate(dictionary, *grey, currentCandidate, currId, params)) {
-                (*validCandidates)[i] = 1;
-                (*idsTmp)[i] = currId;
-            }
-        }
+        for(int c = begin; c < end; c++)
+            identifyChunk((*chunks)[c]);
     }
 
     private:
     IdentifyCandidatesParallel &operator=(const IdentifyCandidatesParallel &); // to quiet MSVC
 
+    void identifyChunk(IdentificationChunk &chunk) const {
+
+        chunk.accepted.clear();
+        chunk.ids.clear();
+        chunk.rotations.clear();
+        if(!cache.empty()) {
+            chunk.cacheEntries.assign(chunk.end - chunk.begin, -1);
+            chunk.cacheHits.assign(chunk.end - chunk.begin, 0);
+        }
+
+        for(int i = chunk.begin; i < chunk.end; i++) {
+            int currId, currRotation;
+            Mat currentCandidate = candidates.getMat(i);
+
+            // first, check if the candidate is a marker identified in the previous frames
+            if(!cache.empty()) {
+                Point2f center;
+                float size;
+                _getCandidateCenterAndSize(currentCandidate, center, size);
+                int entryIdx = cache->find(center, size);
+                chunk.cacheEntries[i - chunk.begin] = entryIdx;
+                if(entryIdx >= 0) {
+                    currId = cache->getEntry(entryIdx).id;
+                    currRotation = cache->getEntry(entryIdx).rotation;
+                    if(_verifyCachedCandidate(*grey, currentCandidate, dictionary, *kernels,
+                                              *allowed, currId, currRotation, params)) {
+                        _rotateCandidateCorners(currentCandidate, currRotation);
+                        chunk.cacheHits[i - chunk.begin] = 1;
+                        chunk.accepted.push_back(i);
+                        chunk.ids.push_back(currId);
+                        chunk.rotations.push_back(currRotation);
+                        continue;
+                    }
+                }
+            }
+
+            if(_identifyOneCandidate(dictionary, *kernels, *allowed, *grey, currentCandidate,
+                                     currId, currRotation, params)) {
+                chunk.accepted.push_back(i);
+                chunk.ids.push_back(currId);
+                chunk.rotations.push_back(currRotation);
+            }
+        }
+
+        // the contours are only available here, so the contour refinement is done with the
+        // identification
+        if(params->doCornerRefinement && params->cornerRefinementMethod == CORNER_REFINE_CONTOUR) {
+            for(unsigned int k = 0; k < chunk.accepted.size(); k++) {
+                Mat acceptedCorners = candidates.getMat(chunk.accepted[k]);
+                _refineCornersFromContour(*grey, contours.getMat(chunk.accepted[k]),
+                                          acceptedCorners,
+                                          params->cornerRefinementContourEdgeSampling);
+            }
+        }
+    }
+
     const Mat *grey;
     InputArrayOfArrays candidates, contours;
     Ptr<Dictionary> &dictionary;
-    vector< int > *idsTmp;
-    vector< char > *validCandidates;
+    const MarkerKernels *kernels;
+    const AllowedIds *allowed;
+    vector< IdentificationChunk > *chunks;
+    const Ptr<IdentificationCache> &cache;
     const Ptr<DetectorParameters> &params;
 };
 
 
 
+/**
+ * @brief Update the identification cache with the results of the current frame
+ */
+static void _updateIdentificationCache(const Ptr<IdentificationCache> &cache,
+                                       InputArrayOfArrays _candidates,
+                                       const vector< IdentificationChunk > &chunks) {
+
+    int ncandidates = (int)_candidates.total();
+    int hits = 0, invalidations = 0;
+
+    // refresh verified entries and remove the wrong ones before inserting new markers, so that
+    // entries found in this frame are not replaced
+    for(unsigned int c = 0; c < chunks.size(); c++) {
+        const IdentificationChunk &chunk = chunks[c];
+        for(unsigned int k = 0; k < chunk.accepted.size(); k++) {
+            int local = chunk.accepted[k] - chunk.begin;
+            if(chunk.cacheHits[local] == 0) continue;
+            Point2f center;
+            float size;
+            _getCandidateCenterAndSize(_candidates.getMat(chunk.accepted[k]), center, size);
+            cache->update(chunk.cacheEntries[local], center, size, chunk.rotations[k]);
+            hits++;
+        }
+        for(int local = 0; local < chunk.end - chunk.begin; local++) {
+            if(chunk.cacheEntries[local] >= 0 && chunk.cacheHits[local] == 0) {
+                cache->invalidate(chunk.cacheEntries[local]);
+                invalidations++;
+            }
+        }
+    }
+
+    for(unsigned int c = 0; c < chunks.size(); c++) {
+        const IdentificationChunk &chunk = chunks[c];
+        for(unsigned int k = 0; k < chunk.accepted.size(); k++) {
+            if(chunk.cacheHits[chunk.accepted[k] - chunk.begin] == 1) continue;
+            Point2f center;
+            float size;
+            _getCandidateCenterAndSize(_candidates.getMat(chunk.accepted[k]), center, size);
+            cache->insert(center, size, chunk.ids[k], chunk.rotations[k]);
+        }
+    }
+
+    cache->addStats(ncandidates, hits, invalidations);
+}
+
+
+
 /**
  * @brief Copy the contents of a Mat vector to an OutputArray, settings its size.
  */
@@ -625,6 +1331,44 @@ void _copyVector2Output(vector< Mat > &vec, OutputArrayOfArrays out) {
 
 
 
+/**
+ * @brief Copy the candidates given by a list of indexes to an OutputArray, settings its size.
+ */
+static void _copyCandidates2Output(InputArrayOfArrays candidates, const vector< int > &indexes,
+                                   OutputArrayOfArrays out) {
+
+    out.release();
+    out.create((int)indexes.size(), 1, CV_32FC2);
+
+    if(out.isMatVector()) {
+        for (unsigned int i = 0; i < indexes.size(); i++) {
+            out.create(4, 1, CV_32FC2, i, true);
+            Mat &m = out.getMatRef(i);
+            candidates.getMat(indexes[i]).copyTo(m);
+        }
+    }
+    else if(out.isUMatVector()) {
+        for (unsigned int i = 0; i < indexes.size(); i++) {
+            out.create(4, 1, CV_32FC2, i, true);
+            UMat &m = out.getUMatRef(i);
+            candidates.getMat(indexes[i]).copyTo(m);
+        }
+    }
+    else if(out.kind() == _OutputArray::STD_VECTOR_VECTOR){
+        for (unsigned int i = 0; i < indexes.size(); i++) {
+            out.create(4, 1, CV_32FC2, i, true);
+            Mat m = out.getMat(i);
+            candidates.getMat(indexes[i]).copyTo(m);
+        }
+    }
+    else {
+        CV_Error(cv::Error::StsNotImplemented,
+                 "Only Mat vector, UMat vector, and vector<vector> OutputArrays are currently supported.");
+    }
+}
+
+
+
 /**
  * @brief Identify square candidates according to a marker dictionary
  */
@@ -632,21 +1376,31 @@ static void _identifyCandidates(InputArray _image, InputArrayOfArrays _candidate
                                 InputArrayOfArrays _contours, Ptr<Dictionary> &_dictionary,
                                 OutputArrayOfArrays _accepted, OutputArray _ids,
                                 const Ptr<DetectorParameters> &params,
-                                OutputArrayOfArrays _rejected = noArray()) {
+                                OutputArrayOfArrays _rejected = noArray(),
+                                const Ptr<IdentificationCache> &cache = Ptr<IdentificationCache>()) {
 
     int ncandidates = (int)_candidates.total();
 
-    vector< Mat > accepted;
-    vector< Mat > rejected;
-    vector< int > ids;
-
     CV_Assert(_image.getMat().total() != 0);
 
     Mat grey;
     _convertToGrey(_image.getMat(), grey);
 
-    vector< int > idsTmp(ncandidates, -1);
-    vector< char > validCandidates(ncandidates, 0);
+    if(!cache.empty()) cache->nextFrame();
+
+    // markers out of the allowed ids are not even compared
+    Ptr<Dictionary> &dictionary = _dictionary;
+    AllowedIds allowed(*dictionary, params->allowedIds);
+
+    // kernels specialized for the marker and border sizes, selected once for all the candidates
+    const MarkerKernels &kernels = dictionary->getKernels(params->markerBorderBits);
+
+    // contiguous chunks of candidates with similar estimated cost
+    int warpedSize =
+        (dictionary->markerSize + 2 * params->markerBorderBits) *
+        params->perspectiveRemovePixelPerCell;
+    vector< IdentificationChunk > chunks;
+    _partitionCandidates(_candidates, warpedSize * warpedSize, chunks);
 
     //// Analyze each of the candidates
     // for (int i = 0; i < ncandidates; i++) {
@@ -659,32 +1413,81 @@ static void _identifyCandidates(InputArray _image, InputArrayOfArrays _candidate
     //}
 
     // this is the parallel call for the previous commented loop (result is equivalent)
-    parallel_for_(Range(0, ncandidates),
-                  IdentifyCandidatesParallel(&grey, _candidates, _contours, _dictionary, &idsTmp,
-                                             &validCandidates, params));
-
-    for(int i = 0; i < ncandidates; i++) {
-        if(validCandidates[i] == 1) {
-            accepted.push_back(_candidates.getMat(i));
-            ids.push_back(idsTmp[i]);
-        } else {
-            rejected.push_back(_candidates.getMat(i));
+    // one stripe per chunk, so that each chunk is processed by a single thread
+    parallel_for_(Range(0, (int)chunks.size()),
+                  IdentifyCandidatesParallel(&grey, _candidates, _contours, dictionary,
+                                             &kernels, &allowed, &chunks, cache, params),
+                  (double)chunks.size());
+
+    if(!cache.empty()) _updateIdentificationCache(cache, _candidates, chunks);
+
+    // position of each chunk in the outputs, prefix sum of the number of accepted candidates
+    vector< int > acceptedOffsets(chunks.size() + 1, 0);
+    for(unsigned int c = 0; c < chunks.size(); c++)
+        acceptedOffsets[c + 1] = acceptedOffsets[c] + (int)chunks[c].accepted.size();
+    int naccepted = acceptedOffsets[chunks.size()];
+
+    vector< int > accepted(naccepted), rejected(ncandidates - naccepted);
+    _ids.create(naccepted, 1, CV_32SC1);
+    int *ids = _ids.getMat().ptr< int >(0);
+    for(unsigned int c = 0; c < chunks.size(); c++) {
+        const IdentificationChunk &chunk = chunks[c];
+        int acceptedPos = acceptedOffsets[c];
+        // candidates before the chunk minus the accepted ones
+        int rejectedPos = chunk.begin - acceptedOffsets[c];
+        int k = 0;
+        for(int i = chunk.begin; i < chunk.end; i++) {
+            if(k < (int)chunk.accepted.size() && chunk.accepted[k] == i) {
+                accepted[acceptedPos] = i;
+                ids[acceptedPos] = chunk.ids[k];
+                acceptedPos++;
+                k++;
+            } else {
+                rejected[rejectedPos++] = i;
+            }
         }
     }
 
     // parse output
-    _copyVector2Output(accepted, _accepted);
-
-    _ids.create((int)ids.size(), 1, CV_32SC1);
-    for(unsigned int i = 0; i < ids.size(); i++)
-        _ids.getMat().ptr< int >(0)[i] = ids[i];
+    _copyCandidates2Output(_candidates, accepted, _accepted);
 
     if(_rejected.needed()) {
-        _copyVector2Output(rejected, _rejected);
+        _copyCandidates2Output(_candidates, rejected, _rejected);
     }
 }
 
 
+/**
+  * @brief Check if a point is inside or on the border of a convex quad, regardless of the
+  * orientation of its corners
+  */
+static inline bool _isInsideConvexQuad(const Point2f *quad, const Point2f &point) {
+
+    float area = 0;
+    for(int j = 0; j < 4; j++)
+        area += quad[j].x * quad[(j + 1) % 4].y - quad[(j + 1) % 4].x * quad[j].y;
+    float orientation = area >= 0 ? 1.f : -1.f;
+
+    for(int j = 0; j < 4; j++) {
+        Point2f edge = quad[(j + 1) % 4] - quad[j];
+        Point2f toPoint = point - quad[j];
+        if(orientation * (edge.x * toPoint.y - edge.y * toPoint.x) < 0) return false;
+    }
+    return true;
+}
+
+
+/**
+  * @brief Check if the four corners of a marker are inside another marker
+  */
+static inline bool _isMarkerInsideMarker(const Point2f *inner, const Point2f *outer) {
+
+    for(int p = 0; p < 4; p++)
+        if(!_isInsideConvexQuad(outer, inner[p])) return false;
+    return true;
+}
+
+
 /**
   * @brief Final filter of markers after its identification
   */
@@ -694,68 +1497,94 @@ static void _filterDetectedMarkers(InputArrayOfArrays _inCorners, InputArray _in
     CV_Assert(_inCorners.total() == _inIds.total());
     if(_inCorners.total() == 0) return;
 
+    int nMarkers = (int)_inCorners.total();
+    Mat inIds = _inIds.getMat();
+    const int *ids = inIds.ptr< int >(0);
+
+    // group markers by id with a counting sort, ids are small and non negative. Markers keep
+    // their original order inside each group
+    int maxId = 0;
+    for(int i = 0; i < nMarkers; i++)
+        maxId = max(maxId, ids[i]);
+    vector< int > groupStart(maxId + 2, 0);
+    for(int i = 0; i < nMarkers; i++)
+        groupStart[ids[i] + 1]++;
+    bool repeatedIds = false;
+    for(int id = 0; id <= maxId; id++) {
+        if(groupStart[id + 1] > 1) repeatedIds = true;
+        groupStart[id + 1] += groupStart[id];
+    }
+    if(!repeatedIds) return;
+
+    vector< int > sortedMarkers(nMarkers);
+    vector< int > groupPos(groupStart.begin(), groupStart.end() - 1);
+    for(int i = 0; i < nMarkers; i++)
+        sortedMarkers[groupPos[ids[i]]++] = i;
+
+    // corners are read once
+    vector< Point2f > corners(4 * nMarkers);
+    for(int i = 0; i < nMarkers; i++) {
+        const Point2f *c = _inCorners.getMat(i).ptr< Point2f >(0);
+        for(int p = 0; p < 4; p++)
+            corners[4 * i + p] = c[p];
+    }
+
     // mark markers that will be removed
-    vector< bool > toRemove(_inCorners.total(), false);
+    vector< bool > toRemove(nMarkers, false);
     bool atLeastOneRemove = false;
 
     // remove repeated markers with same id, if one contains the other (doble border bug)
-    for(unsigned int i = 0; i < _inCorners.total() - 1; i++) {
-        for(unsigned int j = i + 1; j < _inCorners.total(); j++) {
-            if(_inIds.getMat().ptr< int >(0)[i] != _inIds.getMat().ptr< int >(0)[j]) continue;
-
-            // check if first marker is inside second
-            bool inside = true;
-            for(unsigned int p = 0; p < 4; p++) {
-                Point2f point = _inCorners.getMat(j).ptr< Point2f >(0)[p];
-                if(pointPolygonTest(_inCorners.getMat(i), point, false) < 0) {
-                    inside = false;
-                    break;
+    for(int id = 0; id <= maxId; id++) {
+        for(int gi = groupStart[id]; gi < groupStart[id + 1] - 1; gi++) {
+            for(int gj = gi + 1; gj < groupStart[id + 1]; gj++) {
+                int i = sortedMarkers[gi];
+                int j = sortedMarkers[gj];
+
+                // check if first marker is inside second
+                if(_isMarkerInsideMarker(&corners[4 * j], &corners[4 * i])) {
+                    toRemove[j] = true;
+                    atLeastOneRemove = true;
+                    continue;
                 }
-            }
-            if(inside) {
-                toRemove[j] = true;
-                atLeastOneRemove = true;
-                continue;
-            }
 
-            // check the second marker
-            inside = true;
-            for(unsigned int p = 0; p < 4; p++) {
-                Point2f point = _inCorners.getMat(i).ptr< Point2f >(0)[p];
-                if(pointPolygonTest(_inCorners.getMat(j), point, false) < 0) {
-                    inside = false;
-                    break;
+                // check the second marker
+                if(_isMarkerInsideMarker(&corners[4 * i], &corners[4 * j])) {
+                    toRemove[i] = true;
+                    atLeastOneRemove = true;
                 }
             }
-            if(inside) {
-                toRemove[i] = true;
-                atLeastOneRemove = true;
-                continue;
-            }
         }
     }
 
-    // parse output
+    // parse output, surviving markers are compacted in order from the copy of the corners, so
+    // input and output can be the same arrays
     if(atLeastOneRemove) {
-        vector< Mat > filteredCorners;
-        vector< int > filteredIds;
-
-        for(unsigned int i = 0; i < toRemove.size(); i++) {
-            if(!toRemove[i]) {
-                filteredCorners.push_back(_inCorners.getMat(i).clone());
-                filteredIds.push_back(_inIds.getMat().ptr< int >(0)[i]);
-            }
+        int nFiltered = 0;
+        for(int i = 0; i < nMarkers; i++)
+            if(!toRemove[i]) nFiltered++;
+
+        _outCorners.create(nFiltered, 1, CV_32FC2);
+        int k = 0;
+        for(int i = 0; i < nMarkers; i++) {
+            if(toRemove[i]) continue;
+            _outCorners.create(4, 1, CV_32FC2, k, true);
+            Mat outMarker = _outCorners.getMat(k);
+            Point2f *c = outMarker.ptr< Point2f >(0);
+            for(int p = 0; p < 4; p++)
+                c[p] = corners[4 * i + p];
+            k++;
         }
 
-        _outIds.create((int)filteredIds.size(), 1, CV_32SC1);
-        for(unsigned int i = 0; i < filteredIds.size(); i++)
-            _outIds.getMat().ptr< int >(0)[i] = filteredIds[i];
-
-        _outCorners.create((int)filteredCorners.size(), 1, CV_32FC2);
-        for(unsigned int i = 0; i < filteredCorners.size(); i++) {
-            _outCorners.create(4, 1, CV_32FC2, i, true);
-            filteredCorners[i].copyTo(_outCorners.getMat(i));
-        }
+        // ids are copied before recreating the output, that may be the input
+        vector< int > filteredIds;
+        filteredIds.reserve(nFiltered);
+        for(int i = 0; i < nMarkers; i++)
+            if(!toRemove[i]) filteredIds.push_back(ids[i]);
+
+        _outIds.create(nFiltered, 1, CV_32SC1);
+        Mat outIds = _outIds.getMat();
+        for(int i = 0; i < nFiltered; i++)
+            outIds.ptr< int >(0)[i] = filteredIds[i];
     }
 }
 
@@ -781,43 +1610,194 @@ static void _getSingleMarkerObjectPoints(float markerLength, OutputArray _objPoi
 
 
 /**
-  * ParallelLoopBody class for the parallelization of the marker corner subpixel refinement
-  * Called from function detectMarkers()
+  * @brief Corner subpixel refinement of a batch of corners. Same algorithm than cornerSubPix
+  * (without zero zone), but the Gaussian window weights are computed once for the whole batch
+  * and the sampling and gradient buffers are allocated once per thread and reused for all its
+  * corners and iterations. The inner loops run over contiguous float buffers so that they can be
+  * vectorized by the compiler.
   */
-class MarkerSubpixelParallel : public ParallelLoopBody {
+class CornerSubpixRefiner : public ParallelLoopBody {
     public:
-    MarkerSubpixelParallel(const Mat *_grey, OutputArrayOfArrays _corners,
-                           const Ptr<DetectorParameters> &_params)
-        : grey(_grey), corners(_corners), params(_params) {}
+    CornerSubpixRefiner(const Mat &_grey, Point2f *_corners, int _winSize, int _maxIterations,
+                        double _minAccuracy)
+        : grey(_grey), corners(_corners), winSize(_winSize), maxIterations(_maxIterations),
+          epsilon(_minAccuracy * _minAccuracy) {
+
+        CV_Assert(grey.type() == CV_8UC1);
+        CV_Assert(winSize > 0 && maxIterations > 0 && _minAccuracy > 0);
+
+        // Gaussian weights of the window, shared by all the corners
+        int winSide = 2 * winSize + 1;
+        vector< float > weights1D(winSide);
+        double coeff = 1. / (winSize * winSize);
+        for(int i = -winSize; i <= winSize; i++)
+            weights1D[i + winSize] = (float)exp(-i * i * coeff);
+        mask.resize(winSide * winSide);
+        for(int i = 0; i < winSide; i++)
+            for(int j = 0; j < winSide; j++)
+                mask[i * winSide + j] = weights1D[i] * weights1D[j];
+    }
 
     void operator()(const Range &range) const {
-        const int begin = range.start;
-        const int end = range.end;
 
-        for(int i = begin; i < end; i++) {
-            cornerSubPix(*grey, corners.getMat(i),
-                         Size(params->cornerRefinementWinSize, params->cornerRefinementWinSize),
-                         Size(-1, -1), TermCriteria(TermCriteria::MAX_ITER | TermCriteria::EPS,
-                                                    params->cornerRefinementMaxIterations,
-                                                    params->cornerRefinementMinAccuracy));
-        }
+        int winSide = 2 * winSize + 1;
+        int patchSide = winSide + 2;
+        vector< float > patch(patchSide * patchSide);
+        vector< float > gx(winSide * winSide), gy(winSide * winSide);
+        vector< int > xIdx(patchSide + 1);
+
+        for(int i = range.start; i < range.end; i++)
+            corners[i] = refineCorner(corners[i], &patch[0], &gx[0], &gy[0], &xIdx[0]);
     }
 
     private:
-    MarkerSubpixelParallel &operator=(const MarkerSubpixelParallel &); // to quiet MSVC
+    CornerSubpixRefiner &operator=(const CornerSubpixRefiner &); // to quiet MSVC
+
+    /**
+      * @brief Bilinear sampling of the window around center plus one pixel on each side, with
+      * replicated image border
+      */
+    void samplePatch(Point2f center, float *patch, int *xIdx) const {
+
+        int patchSide = 2 * winSize + 3;
+        float x0 = center.x - (winSize + 1), y0 = center.y - (winSize + 1);
+        int ix = cvFloor(x0), iy = cvFloor(y0);
+        float a = x0 - ix, b = y0 - iy;
+        float w00 = (1.f - a) * (1.f - b), w01 = a * (1.f - b);
+        float w10 = (1.f - a) * b, w11 = a * b;
+
+        for(int j = 0; j <= patchSide; j++)
+            xIdx[j] = min(max(ix + j, 0), grey.cols - 1);
+
+        bool insideX = ix >= 0 && ix + patchSide < grey.cols;
+        for(int i = 0; i < patchSide; i++) {
+            const uchar *r0 = grey.ptr< uchar >(min(max(iy + i, 0), grey.rows - 1));
+            const uchar *r1 = grey.ptr< uchar >(min(max(iy + i + 1, 0), grey.rows - 1));
+            float *out = patch + i * patchSide;
+            if(insideX) {
+                r0 += ix;
+                r1 += ix;
+                for(int j = 0; j < patchSide; j++)
+                    out[j] = w00 * r0[j] + w01 * r0[j + 1] + w10 * r1[j] + w11 * r1[j + 1];
+            } else {
+                for(int j = 0; j < patchSide; j++)
+                    out[j] = w00 * r0[xIdx[j]] + w01 * r0[xIdx[j + 1]] + w10 * r1[xIdx[j]] +
+                             w11 * r1[xIdx[j + 1]];
+            }
+        }
+    }
 
-    const Mat *grey;
-    OutputArrayOfArrays corners;
-    const Ptr<DetectorParameters> &params;
+    Point2f refineCorner(Point2f initial, float *patch, float *gx, float *gy, int *xIdx) const {
+
+        int winSide = 2 * winSize + 1;
+        int patchSide = winSide + 2;
+        Point2f current = initial;
+
+        for(int iter = 0; iter < maxIterations; iter++) {
+            samplePatch(current, patch, xIdx);
+
+            // gradients of the window
+            for(int i = 0; i < winSide; i++) {
+                const float *above = patch + i * patchSide + 1;
+                const float *row = patch + (i + 1) * patchSide;
+                const float *below = patch + (i + 2) * patchSide + 1;
+                float *gxRow = gx + i * winSide, *gyRow = gy + i * winSide;
+                for(int j = 0; j < winSide; j++) {
+                    gxRow[j] = row[j + 2] - row[j];
+                    gyRow[j] = below[j] - above[j];
+                }
+            }
+
+            double a = 0, b = 0, c = 0, bb1 = 0, bb2 = 0;
+            for(int i = 0; i < winSide; i++) {
+                const float *m = &mask[i * winSide];
+                const float *gxRow = gx + i * winSide, *gyRow = gy + i * winSide;
+                float py = (float)(i - winSize);
+                float ra = 0, rb = 0, rc = 0, rbb1 = 0, rbb2 = 0;
+                for(int j = 0; j < winSide; j++) {
+                    float px = (float)(j - winSize);
+                    float gxx = gxRow[j] * gxRow[j] * m[j];
+                    float gxy = gxRow[j] * gyRow[j] * m[j];
+                    float gyy = gyRow[j] * gyRow[j] * m[j];
+                    ra += gxx;
+                    rb += gxy;
+                    rc += gyy;
+                    rbb1 += gxx * px + gxy * py;
+                    rbb2 += gxy * px + gyy * py;
+                }
+                a += ra;
+                b += rb;
+                c += rc;
+                bb1 += rbb1;
+                bb2 += rbb2;
+            }
+
+            double det = a * c - b * b;
+            if(fabs(det) <= DBL_EPSILON * DBL_EPSILON) break;
+
+            double scale = 1. / det;
+            Point2f next((float)(current.x + c * scale * bb1 - b * scale * bb2),
+                         (float)(current.y - b * scale * bb1 + a * scale * bb2));
+            double err = (next.x - current.x) * (next.x - current.x) +
+                         (next.y - current.y) * (next.y - current.y);
+            current = next;
+            if(current.x < 0 || current.x >= grey.cols || current.y < 0 ||
+               current.y >= grey.rows)
+                break;
+            if(err <= epsilon) break;
+        }
+
+        // discard the result if the corner has moved out of the window
+        if(fabs(current.x - initial.x) > winSize || fabs(current.y - initial.y) > winSize)
+            return initial;
+        return current;
+    }
+
+    const Mat &grey;
+    Point2f *corners;
+    int winSize, maxIterations;
+    double epsilon;
+    vector< float > mask;
 };
 
 
+/**
+  * @brief Refine the corners of a set of markers as a single batch
+  */
+static void _refineCornersSubpix(const Mat &grey, InputOutputArrayOfArrays _corners,
+                                 const DetectorParameters &params) {
+
+    int nMarkers = (int)_corners.total();
+    if(nMarkers == 0) return;
+
+    // all the corners in a single buffer
+    vector< Point2f > allCorners(4 * nMarkers);
+    for(int i = 0; i < nMarkers; i++) {
+        Mat marker = _corners.getMat(i);
+        for(int p = 0; p < 4; p++)
+            allCorners[4 * i + p] = marker.ptr< Point2f >(0)[p];
+    }
+
+    parallel_for_(Range(0, (int)allCorners.size()),
+                  CornerSubpixRefiner(grey, &allCorners[0], params.cornerRefinementWinSize,
+                                      params.cornerRefinementMaxIterations,
+                                      params.cornerRefinementMinAccuracy));
+
+    for(int i = 0; i < nMarkers; i++) {
+        Mat marker = _corners.getMat(i);
+        for(int p = 0; p < 4; p++)
+            marker.ptr< Point2f >(0)[p] = allCorners[4 * i + p];
+    }
+}
+
+
 
 /**
   */
 void detectMarkers(InputArray _image, Ptr<Dictionary> &_dictionary, OutputArrayOfArrays _corners,
                    OutputArray _ids, const Ptr<DetectorParameters> &_params,
-                   OutputArrayOfArrays _rejectedImgPoints) {
+                   OutputArrayOfArrays _rejectedImgPoints,
+                   const Ptr<IdentificationCache> &_identificationCache) {
 
     CV_Assert(_image.getMat().total() != 0);
 
@@ -831,64 +1811,285 @@ void detectMarkers(InputArray _image, Ptr<Dictionary> &_dictionary, OutputArrayO
 
     /// STEP 2: Check candidate codification (identify markers)
     _identifyCandidates(grey, candidates, contours, _dictionary, _corners, _ids, _params,
-                        _rejectedImgPoints);
+                        _rejectedImgPoints, _identificationCache);
 
     /// STEP 3: Filter detected markers;
     _filterDetectedMarkers(_corners, _ids, _corners, _ids);
 
-    /// STEP 4: Corner refinement
-    if(_params->doCornerRefinement) {
+    /// STEP 4: Corner refinement, the contour method is already applied during identification
+    if(_params->doCornerRefinement && _params->cornerRefinementMethod == CORNER_REFINE_SUBPIX) {
         CV_Assert(_params->cornerRefinementWinSize > 0 && _params->cornerRefinementMaxIterations > 0 &&
                   _params->cornerRefinementMinAccuracy > 0);
 
-        //// do corner refinement for each of the detected markers
-        // for (unsigned int i = 0; i < _corners.total(); i++) {
-        //    cornerSubPix(grey, _corners.getMat(i),
-        //                 Size(params.cornerRefinementWinSize, params.cornerRefinementWinSize),
-        //                 Size(-1, -1), TermCriteria(TermCriteria::MAX_ITER | TermCriteria::EPS,
-        //                                            params.cornerRefinementMaxIterations,
-        //                                            params.cornerRefinementMinAccuracy));
-        //}
+        // all the corners of all the detected markers are refined as one parallel batch
+        _refineCornersSubpix(grey, _corners, *_params);
+    }
+}
+
 
-        // this is the parallel call for the previous commented loop (result is equivalent)
-        parallel_for_(Range(0, (int)_corners.total()),
-                      MarkerSubpixelParallel(&grey, _corners, _params));
+
+/**
+  * @brief Rotation vector of a rotation matrix, as Rodrigues()
+  */
+static Vec3d _rotationMatrixToVector(const Matx33d &R) {
+
+    double c = (R(0, 0) + R(1, 1) + R(2, 2) - 1.) * 0.5;
+    c = c > 1. ? 1. : c < -1. ? -1. : c;
+    Vec3d r(R(2, 1) - R(1, 2), R(0, 2) - R(2, 0), R(1, 0) - R(0, 1));
+    double s = sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2]) * 0.5;
+
+    if(s > 1e-5) {
+        double theta = atan2(s, c);
+        return r * (theta / (2. * s));
     }
+    if(c > 0) return r * 0.5; // almost identity
+
+    // rotation of almost pi radians, the axis is taken from the diagonal
+    double rx = sqrt(max((R(0, 0) + 1.) * 0.5, 0.));
+    double ry = sqrt(max((R(1, 1) + 1.) * 0.5, 0.)) * (R(0, 1) < 0 ? -1. : 1.);
+    double rz = sqrt(max((R(2, 2) + 1.) * 0.5, 0.)) * (R(0, 2) < 0 ? -1. : 1.);
+    if(fabs(rx) < fabs(ry) && fabs(rx) < fabs(rz) && (R(1, 2) > 0) != (ry * rz > 0)) rz = -rz;
+    double norm = sqrt(rx * rx + ry * ry + rz * rz);
+    return Vec3d(rx, ry, rz) * (CV_PI / norm);
 }
 
 
+/**
+  * @brief Rotation matrix of a rotation vector, as Rodrigues()
+  */
+static Matx33d _rotationVectorToMatrix(const Vec3d &rvec) {
+
+    double theta = sqrt(rvec[0] * rvec[0] + rvec[1] * rvec[1] + rvec[2] * rvec[2]);
+    if(theta < DBL_EPSILON) return Matx33d::eye();
+
+    double x = rvec[0] / theta, y = rvec[1] / theta, z = rvec[2] / theta;
+    double c = cos(theta), s = sin(theta), c1 = 1. - c;
+    return Matx33d(c + c1 * x * x, c1 * x * y - s * z, c1 * x * z + s * y,
+                   c1 * x * y + s * z, c + c1 * y * y, c1 * y * z - s * x,
+                   c1 * x * z - s * y, c1 * y * z + s * x, c + c1 * z * z);
+}
+
 
 /**
-  * ParallelLoopBody class for the parallelization of the single markers pose estimation
-  * Called from function estimatePoseSingleMarkers()
+  * @brief The two IPPE rotations of a plane given the Jacobian J of the homography from the plane
+  * to the normalized image at the origin of the plane, and the image (p, q) of the origin.
+  * Collins and Bartoli, "Infinitesimal Plane-based Pose Estimation", IJCV 2014.
   */
-class SinglePoseEstimationParallel : public ParallelLoopBody {
-    public:
-    SinglePoseEstimationParallel(Mat& _markerObjPoints, InputArrayOfArrays _corners,
-                                 InputArray _cameraMatrix, InputArray _distCoeffs,
-                                 Mat& _rvecs, Mat& _tvecs)
-        : markerObjPoints(_markerObjPoints), corners(_corners), cameraMatrix(_cameraMatrix),
-          distCoeffs(_distCoeffs), rvecs(_rvecs), tvecs(_tvecs) {}
+static bool _computeIPPERotations(double j00, double j01, double j10, double j11, double p,
+                                  double q, Matx33d &R1, Matx33d &R2) {
+
+    // rotation Rv that takes the z axis to the line of sight of the origin of the plane
+    double norm = sqrt(p * p + q * q + 1.);
+    Vec3d t(p / norm, q / norm, 1. / norm);
+    Matx33d Rv = Matx33d::eye();
+    double s = sqrt(t[0] * t[0] + t[1] * t[1]);
+    if(s > DBL_EPSILON) {
+        // rotation around (-t.y, t.x, 0) / s, with cos = t.z and sin = s
+        double ax = -t[1] / s, ay = t[0] / s, c = t[2], c1 = 1. - c;
+        Rv = Matx33d(c + c1 * ax * ax, c1 * ax * ay, s * ay,
+                     c1 * ax * ay, c + c1 * ay * ay, -s * ax,
+                     -s * ay, s * ax, c);
+    }
 
-    void operator()(const Range &range) const {
-        const int begin = range.start;
-        const int end = range.end;
+    // A = B^-1 * J, where B is the first two columns of Rv projected at the origin
+    double b00 = Rv(0, 0) - p * Rv(2, 0), b01 = Rv(0, 1) - p * Rv(2, 1);
+    double b10 = Rv(1, 0) - q * Rv(2, 0), b11 = Rv(1, 1) - q * Rv(2, 1);
+    double det = b00 * b11 - b01 * b10;
+    if(fabs(det) < DBL_EPSILON) return false;
+    double binv00 = b11 / det, binv01 = -b01 / det, binv10 = -b10 / det, binv11 = b00 / det;
+    double a00 = binv00 * j00 + binv01 * j10, a01 = binv00 * j01 + binv01 * j11;
+    double a10 = binv10 * j00 + binv11 * j10, a11 = binv10 * j01 + binv11 * j11;
+
+    // largest singular value of A
+    double ata00 = a00 * a00 + a10 * a10, ata01 = a00 * a01 + a10 * a11;
+    double ata11 = a01 * a01 + a11 * a11;
+    double gamma2 = 0.5 * (ata00 + ata11 +
+                           sqrt((ata00 - ata11) * (ata00 - ata11) + 4. * ata01 * ata01));
+    if(gamma2 < DBL_EPSILON) return false;
+    double gamma = sqrt(gamma2);
+
+    // complete the 2x2 block to the two possible rotations
+    double r00 = a00 / gamma, r01 = a01 / gamma, r10 = a10 / gamma, r11 = a11 / gamma;
+    double b0 = sqrt(max(1. - r00 * r00 - r10 * r10, 0.));
+    double b1 = sqrt(max(1. - r01 * r01 - r11 * r11, 0.));
+    if(-r00 * r01 - r10 * r11 < 0) b1 = -b1;
+
+    for(int sol = 0; sol < 2; sol++) {
+        double sign = sol == 0 ? 1. : -1.;
+        Vec3d c0(r00, r10, sign * b0), c1(r01, r11, sign * b1);
+        Vec3d c2 = c0.cross(c1);
+        Matx33d Rtilde(c0[0], c1[0], c2[0], c0[1], c1[1], c2[1], c0[2], c1[2], c2[2]);
+        (sol == 0 ? R1 : R2) = Rv * Rtilde;
+    }
+    return true;
+}
+
+
+/**
+  * @brief Least squares translation of a planar object given its rotation, from the normalized
+  * image points
+  */
+static bool _computeTranslation(const Point2d *objPoints, const Point2d *imgPoints, int npoints,
+                                const Matx33d &R, Vec3d &tvec) {
+
+    // each point gives two linear equations on t: [1 0 -x] t = x * r3.P - r1.P, and for y
+    Matx33d AtA = Matx33d::zeros();
+    Vec3d Atb(0, 0, 0);
+    for(int i = 0; i < npoints; i++) {
+        double X = objPoints[i].x, Y = objPoints[i].y;
+        double x = imgPoints[i].x, y = imgPoints[i].y;
+        double r1P = R(0, 0) * X + R(0, 1) * Y;
+        double r2P = R(1, 0) * X + R(1, 1) * Y;
+        double r3P = R(2, 0) * X + R(2, 1) * Y;
+        double bx = x * r3P - r1P, by = y * r3P - r2P;
+
+        AtA(0, 0) += 1.;
+        AtA(0, 2) -= x;
+        AtA(1, 1) += 1.;
+        AtA(1, 2) -= y;
+        AtA(2, 2) += x * x + y * y;
+        Atb[0] += bx;
+        Atb[1] += by;
+        Atb[2] -= x * bx + y * by;
+    }
+    AtA(2, 0) = AtA(0, 2);
+    AtA(2, 1) = AtA(1, 2);
+
+    // Cramer's rule on the symmetric 3x3 system
+    double det = AtA(0, 0) * (AtA(1, 1) * AtA(2, 2) - AtA(1, 2) * AtA(2, 1)) -
+                 AtA(0, 1) * (AtA(1, 0) * AtA(2, 2) - AtA(1, 2) * AtA(2, 0)) +
+                 AtA(0, 2) * (AtA(1, 0) * AtA(2, 1) - AtA(1, 1) * AtA(2, 0));
+    if(fabs(det) < DBL_EPSILON) return false;
+    for(int k = 0; k < 3; k++) {
+        Matx33d M = AtA;
+        for(int r = 0; r < 3; r++)
+            M(r, k) = Atb[r];
+        tvec[k] = (M(0, 0) * (M(1, 1) * M(2, 2) - M(1, 2) * M(2, 1)) -
+                   M(0, 1) * (M(1, 0) * M(2, 2) - M(1, 2) * M(2, 0)) +
+                   M(0, 2) * (M(1, 0) * M(2, 1) - M(1, 1) * M(2, 0))) /
+                  det;
+    }
+    return true;
+}
+
+
+/**
+  * @brief Sum of squared reprojection errors in normalized image coordinates
+  */
+static double _getPlanarReprojectionError(const Point2d *objPoints, const Point2d *imgPoints,
+                                          int npoints, const Matx33d &R, const Vec3d &tvec) {
+
+    double error = 0;
+    for(int i = 0; i < npoints; i++) {
+        double X = objPoints[i].x, Y = objPoints[i].y;
+        double z = R(2, 0) * X + R(2, 1) * Y + tvec[2];
+        if(z <= 0) return DBL_MAX; // behind the camera
+        double x = (R(0, 0) * X + R(0, 1) * Y + tvec[0]) / z;
+        double y = (R(1, 0) * X + R(1, 1) * Y + tvec[1]) / z;
+        error += (x - imgPoints[i].x) * (x - imgPoints[i].x) +
+                 (y - imgPoints[i].y) * (y - imgPoints[i].y);
+    }
+    return error;
+}
+
+
+/**
+  * @brief Pose of a square marker from its four corners in normalized image coordinates, with
+  * the same corner order and coordinate system than estimatePoseSingleMarkers. If useGuess is
+  * true, rvec and tvec contain a previous pose used to choose between the two IPPE solutions when
+  * both explain the corners similarly well.
+  */
+static bool _solveSquareMarkerPose(const Point2d *imgPoints, double markerLength, bool useGuess,
+                                   Vec3d &rvec, Vec3d &tvec) {
+
+    // solutions whose errors differ less than this ratio are considered ambiguous
+    const double AMBIGUITY_RATIO = 4.;
+
+    double half = markerLength / 2.;
+    const Point2d objPoints[4] = { Point2d(-half, half), Point2d(half, half),
+                                   Point2d(half, -half), Point2d(-half, -half) };
+
+    // homography from the unit square to the corners, composed with the transformation from the
+    // marker plane to the unit square: u = X / markerLength + 0.5, v = -Y / markerLength + 0.5
+    Point2f quad[4];
+    for(int i = 0; i < 4; i++)
+        quad[i] = Point2f((float)imgPoints[i].x, (float)imgPoints[i].y);
+    double h[8];
+    if(!_getSquareToQuadTransform(quad, h)) return false;
+
+    double H[9] = { h[0] / markerLength, -h[1] / markerLength, 0.5 * (h[0] + h[1]) + h[2],
+                    h[3] / markerLength, -h[4] / markerLength, 0.5 * (h[3] + h[4]) + h[5],
+                    h[6] / markerLength, -h[7] / markerLength, 0.5 * (h[6] + h[7]) + 1. };
+    if(fabs(H[8]) < DBL_EPSILON) return false;
+    for(int i = 0; i < 9; i++)
+        H[i] /= H[8];
+
+    // Jacobian of the homography at the center of the marker
+    double p = H[2], q = H[5];
+    double j00 = H[0] - H[6] * p, j01 = H[1] - H[7] * p;
+    double j10 = H[3] - H[6] * q, j11 = H[4] - H[7] * q;
+
+    Matx33d R[2];
+    if(!_computeIPPERotations(j00, j01, j10, j11, p, q, R[0], R[1])) return false;
+
+    Vec3d t[2];
+    double errors[2];
+    for(int sol = 0; sol < 2; sol++) {
+        if(!_computeTranslation(objPoints, imgPoints, 4, R[sol], t[sol])) return false;
+        errors[sol] = _getPlanarReprojectionError(objPoints, imgPoints, 4, R[sol], t[sol]);
+    }
+    int best = errors[0] <= errors[1] ? 0 : 1;
+    if(errors[best] == DBL_MAX) return false;
+
+    // warm start, keep the solution closest to the previous rotation if it is not clearly worse
+    if(useGuess && tvec[2] > 0) {
+        Matx33d previous = _rotationVectorToMatrix(rvec);
+        double trace[2];
+        for(int sol = 0; sol < 2; sol++) {
+            Matx33d diff = R[sol].t() * previous;
+            trace[sol] = diff(0, 0) + diff(1, 1) + diff(2, 2);
+        }
+        int closest = trace[0] >= trace[1] ? 0 : 1;
+        if(errors[closest] <= AMBIGUITY_RATIO * errors[best]) best = closest;
+    }
+
+    rvec = _rotationMatrixToVector(R[best]);
+    tvec = t[best];
+    return true;
+}
+
+
+
+/**
+  */
+void estimatePoseSingleMarkersIPPE(const Point2f *corners, int nMarkers, float markerLength,
+                                   InputArray _cameraMatrix, InputArray _distCoeffs,
+                                   Vec3d *rvecs, Vec3d *tvecs, bool useExtrinsicGuess) {
 
-        for(int i = begin; i < end; i++) {
-            solvePnP(markerObjPoints, corners.getMat(i), cameraMatrix, distCoeffs,
-                    rvecs.at<Vec3d>(0, i), tvecs.at<Vec3d>(0, i));
-        }
-    }
+    CV_Assert(markerLength > 0 && nMarkers >= 0);
+    if(nMarkers == 0) return;
 
-    private:
-    SinglePoseEstimationParallel &operator=(const SinglePoseEstimationParallel &); // to quiet MSVC
+    // normalized image coordinates of all the corners in a single call
+    Mat allCorners(4 * nMarkers, 1, CV_32FC2, (void *)corners);
+    vector< Point2f > normalized;
+    undistortPoints(allCorners, normalized, _cameraMatrix, _distCoeffs);
 
-    Mat& markerObjPoints;
-    InputArrayOfArrays corners;
-    InputArray cameraMatrix, distCoeffs;
-    Mat& rvecs, tvecs;
-};
+    Mat markerObjPoints;
+    for(int i = 0; i < nMarkers; i++) {
+        Point2d imgPoints[4];
+        for(int c = 0; c < 4; c++)
+            imgPoints[c] = Point2d(normalized[4 * i + c].x, normalized[4 * i + c].y);
+
+        if(_solveSquareMarkerPose(imgPoints, markerLength, useExtrinsicGuess, rvecs[i], tvecs[i]))
+            continue;
 
+        // degenerated corners, use the generic solver
+        if(markerObjPoints.empty()) _getSingleMarkerObjectPoints(markerLength, markerObjPoints);
+        Mat markerCorners(4, 1, CV_32FC2, (void *)(corners + 4 * i));
+        solvePnP(markerObjPoints, markerCorners, _cameraMatrix, _distCoeffs, rvecs[i], tvecs[i],
+                 useExtrinsicGuess);
+    }
+}
 
 
 
@@ -900,28 +2101,61 @@ void estimatePoseSingleMarkers(InputArrayOfArrays _corners, float markerLength,
 
     CV_Assert(markerLength > 0);
 
-    Mat markerObjPoints;
-    _getSingleMarkerObjectPoints(markerLength, markerObjPoints);
     int nMarkers = (int)_corners.total();
     _rvecs.create(nMarkers, 1, CV_64FC3);
     _tvecs.create(nMarkers, 1, CV_64FC3);
+    if(nMarkers == 0) return;
 
     Mat rvecs = _rvecs.getMat(), tvecs = _tvecs.getMat();
 
-    //// for each marker, calculate its pose
-    // for (int i = 0; i < nMarkers; i++) {
-    //    solvePnP(markerObjPoints, _corners.getMat(i), _cameraMatrix, _distCoeffs,
-    //             _rvecs.getMat(i), _tvecs.getMat(i));
-    //}
+    // all the corners in a flat array, solved in one batch by the planar solver
+    vector< Point2f > corners(4 * nMarkers);
+    for(int i = 0; i < nMarkers; i++) {
+        Mat marker = _corners.getMat(i);
+        for(int c = 0; c < 4; c++)
+            corners[4 * i + c] = marker.ptr< Point2f >(0)[c];
+    }
 
-    // this is the parallel call for the previous commented loop (result is equivalent)
-    parallel_for_(Range(0, nMarkers),
-                  SinglePoseEstimationParallel(markerObjPoints, _corners, _cameraMatrix,
-                                               _distCoeffs, rvecs, tvecs));
+    estimatePoseSingleMarkersIPPE(&corners[0], nMarkers, markerLength, _cameraMatrix, _distCoeffs,
+                                  rvecs.ptr< Vec3d >(0), tvecs.ptr< Vec3d >(0));
 }
 
 
 
+/**
+  * @brief Board markers with a given id, using the board table from id to index when it is valid
+  * and a linear scan over the board ids otherwise, e.g. for boards filled by hand without
+  * Board::updateIdIndex(). The table is checked once, when the lookup is created.
+  */
+class BoardMarkerLookup {
+    public:
+    BoardMarkerLookup(const Board &_board) : board(_board), indexed(_board.isIdIndexValid()) {}
+
+    // index of the first board marker with the id, -1 if there is none
+    int first(int id) const {
+        if(indexed) return board.getMarkerIndex(id);
+        return scan(id, 0);
+    }
+
+    // index of the next board marker with the same id than the marker j, -1 if there is none
+    int next(int j) const {
+        if(indexed) return board.getNextMarkerIndex(j);
+        return scan(board.ids[j], j + 1);
+    }
+
+    private:
+    int scan(int id, int from) const {
+        for(int j = from; j < (int)board.ids.size(); j++)
+            if(board.ids[j] == id) return j;
+        return -1;
+    }
+
+    const Board &board;
+    bool indexed;
+};
+
+
+
 /**
   * @brief Given a board configuration and a set of detected markers, returns the corresponding
   * image points and object points to call solvePnP
@@ -942,14 +2176,17 @@ static void _getBoardObjectAndImagePoints(Ptr<Board> &_board, InputArray _detect
     imgPnts.reserve(nDetectedMarkers);
 
     // look for detected markers that belong to the board and get their information
+    Mat detectedIds = _detectedIds.getMat();
+    BoardMarkerLookup boardMarkers(*_board);
     for(unsigned int i = 0; i < nDetectedMarkers; i++) {
-        int currentId = _detectedIds.getMat().ptr< int >(0)[i];
-        for(unsigned int j = 0; j < _board->ids.size(); j++) {
-            if(currentId == _board->ids[j]) {
-                for(int p = 0; p < 4; p++) {
-                    objPnts.push_back(_board->objPoints[j][p]);
-                    imgPnts.push_back(_detectedCorners.getMat(i).ptr< Point2f >(0)[p]);
-                }
+        int j = boardMarkers.first(detectedIds.ptr< int >(0)[i]);
+        if(j < 0) continue;
+        Mat detectedCorners = _detectedCorners.getMat(i);
+        // all the board markers with the id are matched
+        for(; j >= 0; j = boardMarkers.next(j)) {
+            for(int p = 0; p < 4; p++) {
+                objPnts.push_back(_board->objPoints[j][p]);
+                imgPnts.push_back(detectedCorners.ptr< Point2f >(0)[p]);
             }
         }
     }
@@ -966,6 +2203,25 @@ static void _getBoardObjectAndImagePoints(Ptr<Board> &_board, InputArray _detect
 
 
 
+/**
+  * @brief For each marker of the board, index of the first detected marker with its id, or -1 if
+  * it has not been detected
+  */
+static void _getBoardDetectedIndexes(Ptr<Board> &_board, InputArray _detectedIds,
+                                     vector< int > &detectedIndexes) {
+
+    detectedIndexes.assign(_board->ids.size(), -1);
+    Mat detectedIds = _detectedIds.getMat();
+    BoardMarkerLookup boardMarkers(*_board);
+    for(int i = (int)_detectedIds.total() - 1; i >= 0; i--) {
+        for(int j = boardMarkers.first(detectedIds.ptr< int >()[i]); j >= 0;
+            j = boardMarkers.next(j))
+            detectedIndexes[j] = i;
+    }
+}
+
+
+
 /**
   * Project board markers that are not included in the list of detected markers
   */
@@ -987,17 +2243,11 @@ static void _projectUndetectedMarkers(Ptr<Board> &_board, InputOutputArrayOfArra
     // search undetected markers and project them using the previous pose
     vector< vector< Point2f > > undetectedCorners;
     vector< int > undetectedIds;
+    vector< int > detectedIndexes;
+    _getBoardDetectedIndexes(_board, _detectedIds, detectedIndexes);
     for(unsigned int i = 0; i < _board->ids.size(); i++) {
-        int foundIdx = -1;
-        for(unsigned int j = 0; j < _detectedIds.total(); j++) {
-            if(_board->ids[i] == _detectedIds.getMat().ptr< int >()[j]) {
-                foundIdx = j;
-                break;
-            }
-        }
-
         // not detected
-        if(foundIdx == -1) {
+        if(detectedIndexes[i] == -1) {
             undetectedCorners.push_back(vector< Point2f >());
             undetectedIds.push_back(_board->ids[i]);
             projectPoints(_board->objPoints[i], rvec, tvec, _cameraMatrix, _distCoeffs,
@@ -1050,20 +2300,18 @@ static void _projectUndetectedMarkers(Ptr<Board> &_board, InputOutputArrayOfArra
                                                         // missing markers in different vectors
     vector< int > undetectedMarkersIds; // ids of missing markers
     // find markers included in board, and missing markers from board. Fill the previous vectors
+    vector< int > detectedIndexes;
+    _getBoardDetectedIndexes(_board, _detectedIds, detectedIndexes);
     for(unsigned int j = 0; j < _board->ids.size(); j++) {
-        bool found = false;
-        for(unsigned int i = 0; i < _detectedIds.total(); i++) {
-            if(_detectedIds.getMat().ptr< int >()[i] == _board->ids[j]) {
-                for(int c = 0; c < 4; c++) {
-                    imageCornersAll.push_back(_detectedCorners.getMat(i).ptr< Point2f >()[c]);
-                    detectedMarkersObj2DAll.push_back(
-                        Point2f(_board->objPoints[j][c].x, _board->objPoints[j][c].y));
-                }
-                found = true;
-                break;
+        int i = detectedIndexes[j];
+        if(i >= 0) {
+            Mat detectedCorners = _detectedCorners.getMat(i);
+            for(int c = 0; c < 4; c++) {
+                imageCornersAll.push_back(detectedCorners.ptr< Point2f >()[c]);
+                detectedMarkersObj2DAll.push_back(
+                    Point2f(_board->objPoints[j][c].x, _board->objPoints[j][c].y));
             }
-        }
-        if(!found) {
+        } else {
             undetectedMarkersObj2D.push_back(vector< Point2f >());
             for(int c = 0; c < 4; c++) {
                 undetectedMarkersObj2D.back().push_back(
@@ -1095,6 +2343,201 @@ static void _projectUndetectedMarkers(Ptr<Board> &_board, InputOutputArrayOfArra
 
 
 
+/**
+  * @brief Uniform grid over the centroids of a set of candidates. A query returns, in increasing
+  * order, the indexes of all the candidates whose centroid is in the 3x3 cells around a point,
+  * which include all the candidates with centroid closer than the cell size
+  */
+class CandidatesGrid {
+    public:
+    CandidatesGrid(const vector< Point2f > &corners, float minCellSize) {
+
+        const int MAX_CELLS_PER_SIDE = 256;
+
+        int ncandidates = (int)corners.size() / 4;
+        centroids.resize(ncandidates);
+        Point2f minCorner(FLT_MAX, FLT_MAX), maxCorner(-FLT_MAX, -FLT_MAX);
+        for(int j = 0; j < ncandidates; j++) {
+            const Point2f *c = &corners[4 * j];
+            centroids[j] = (c[0] + c[1] + c[2] + c[3]) * 0.25f;
+            minCorner.x = min(minCorner.x, centroids[j].x);
+            minCorner.y = min(minCorner.y, centroids[j].y);
+            maxCorner.x = max(maxCorner.x, centroids[j].x);
+            maxCorner.y = max(maxCorner.y, centroids[j].y);
+        }
+
+        // bigger cells are still correct, they only return more candidates
+        origin = minCorner;
+        cellSize = max(minCellSize, max(maxCorner.x - minCorner.x, maxCorner.y - minCorner.y) /
+                                        MAX_CELLS_PER_SIDE);
+        cellSize = max(cellSize, FLT_EPSILON);
+        cols = (int)((maxCorner.x - minCorner.x) / cellSize) + 1;
+        rows = (int)((maxCorner.y - minCorner.y) / cellSize) + 1;
+
+        // candidates sorted by cell with a counting sort, increasing index inside each cell
+        vector< int > cells(ncandidates);
+        cellStart.assign(rows * cols + 1, 0);
+        for(int j = 0; j < ncandidates; j++) {
+            cells[j] = getCell(centroids[j]);
+            cellStart[cells[j] + 1]++;
+        }
+        for(int c = 0; c < rows * cols; c++)
+            cellStart[c + 1] += cellStart[c];
+        cellItems.resize(ncandidates);
+        vector< int > cellPos(cellStart.begin(), cellStart.end() - 1);
+        for(int j = 0; j < ncandidates; j++)
+            cellItems[cellPos[cells[j]]++] = j;
+    }
+
+    void query(Point2f point, vector< int > &nearCandidates) const {
+
+        nearCandidates.clear();
+        int cx = cvFloor((point.x - origin.x) / cellSize);
+        int cy = cvFloor((point.y - origin.y) / cellSize);
+        for(int y = max(cy - 1, 0); y <= min(cy + 1, rows - 1); y++) {
+            for(int x = max(cx - 1, 0); x <= min(cx + 1, cols - 1); x++) {
+                int c = y * cols + x;
+                nearCandidates.insert(nearCandidates.end(), cellItems.begin() + cellStart[c],
+                                      cellItems.begin() + cellStart[c + 1]);
+            }
+        }
+        sort(nearCandidates.begin(), nearCandidates.end());
+    }
+
+    private:
+    int getCell(Point2f point) const {
+        int cx = min((int)((point.x - origin.x) / cellSize), cols - 1);
+        int cy = min((int)((point.y - origin.y) / cellSize), rows - 1);
+        return cy * cols + cx;
+    }
+
+    vector< Point2f > centroids;
+    Point2f origin;
+    float cellSize;
+    int rows, cols;
+    vector< int > cellStart, cellItems;
+};
+
+
+
+/**
+  * @brief Possible match between a missing marker and a rejected candidate, with the maximum
+  * squared corner distance for each first corner of the candidate
+  */
+struct RefinePairing {
+    int candidate;
+    double distances[4];
+};
+
+
+/**
+  * ParallelLoopBody class for the parallelization of the pairing of missing markers and rejected
+  * candidates. Called from function refineDetectedMarkers()
+  */
+class RefinePairingParallel : public ParallelLoopBody {
+    public:
+    RefinePairingParallel(const vector< vector< Point2f > > *_markersCorners,
+                          const vector< Point2f > *_rejectedCorners, const CandidatesGrid *_grid,
+                          double _maxDistance, bool _checkAllOrders,
+                          vector< vector< RefinePairing > > *_pairings)
+        : markersCorners(_markersCorners), rejectedCorners(_rejectedCorners), grid(_grid),
+          maxDistance(_maxDistance), checkAllOrders(_checkAllOrders), pairings(_pairings) {}
+
+    void operator()(const Range &range) const {
+        const int begin = range.start;
+        const int end = range.end;
+
+        vector< int > nearCandidates;
+        for(int i = begin; i < end; i++) {
+            const vector< Point2f > &marker = (*markersCorners)[i];
+            vector< RefinePairing > &markerPairings = (*pairings)[i];
+            markerPairings.clear();
+
+            grid->query((marker[0] + marker[1] + marker[2] + marker[3]) * 0.25f, nearCandidates);
+            for(unsigned int n = 0; n < nearCandidates.size(); n++) {
+                RefinePairing pairing;
+                pairing.candidate = nearCandidates[n];
+                const Point2f *candidateCorners = &(*rejectedCorners)[4 * pairing.candidate];
+
+                bool possible = false;
+                int nOrders = checkAllOrders ? 4 : 1;
+                for(int c = 0; c < 4; c++) { // first corner in rejected candidate
+                    pairing.distances[c] = DBL_MAX;
+                    if(c >= nOrders) continue;
+                    double currentMaxDistance = 0;
+                    for(int k = 0; k < 4; k++) {
+                        Point2f distVector = marker[k] - candidateCorners[(c + k) % 4];
+                        double cornerDist =
+                            distVector.x * distVector.x + distVector.y * distVector.y;
+                        currentMaxDistance = max(currentMaxDistance, cornerDist);
+                    }
+                    pairing.distances[c] = currentMaxDistance;
+                    if(currentMaxDistance < maxDistance) possible = true;
+                }
+                if(possible) markerPairings.push_back(pairing);
+            }
+        }
+    }
+
+    private:
+    RefinePairingParallel &operator=(const RefinePairingParallel &); // to quiet MSVC
+
+    const vector< vector< Point2f > > *markersCorners;
+    const vector< Point2f > *rejectedCorners;
+    const CandidatesGrid *grid;
+    double maxDistance;
+    bool checkAllOrders;
+    vector< vector< RefinePairing > > *pairings;
+};
+
+
+/**
+  * ParallelLoopBody class for the parallelization of the bit extraction of the rejected
+  * candidates that can match a missing marker. Called from function refineDetectedMarkers()
+  */
+class RefineExtractBitsParallel : public ParallelLoopBody {
+    public:
+    RefineExtractBitsParallel(const Mat *_grey, const vector< Point2f > *_rejectedCorners,
+                              const vector< int > *_candidates, const MarkerKernels *_kernels,
+                              int _markerSize, const DetectorParameters *_params,
+                              Mat *_rejectedBytes)
+        : grey(_grey), rejectedCorners(_rejectedCorners), candidates(_candidates),
+          kernels(_kernels), markerSize(_markerSize), params(_params),
+          rejectedBytes(_rejectedBytes) {}
+
+    void operator()(const Range &range) const {
+        const int begin = range.start;
+        const int end = range.end;
+
+        for(int n = begin; n < end; n++) {
+            int j = (*candidates)[n];
+            Mat candidate(4, 1, CV_32FC2, (void *)&(*rejectedCorners)[4 * j]);
+            Mat bits = _extractBits(*grey, candidate, markerSize, params->markerBorderBits,
+                                    params->perspectiveRemovePixelPerCell,
+                                    params->perspectiveRemoveIgnoredMarginPerCell,
+                                    params->minOtsuStdDev);
+
+            int border = params->markerBorderBits;
+            Mat onlyBits =
+                bits.rowRange(border, bits.rows - border).colRange(border, bits.rows - border);
+            kernels->packBits(onlyBits, markerSize, rejectedBytes->ptr(j));
+        }
+    }
+
+    private:
+    RefineExtractBitsParallel &operator=(const RefineExtractBitsParallel &); // to quiet MSVC
+
+    const Mat *grey;
+    const vector< Point2f > *rejectedCorners;
+    const vector< int > *candidates;
+    const MarkerKernels *kernels;
+    int markerSize;
+    const DetectorParameters *params;
+    Mat *rejectedBytes;
+};
+
+
+
 /**
   */
 void refineDetectedMarkers(InputArray _image, Ptr<Board> &_board,
@@ -1147,15 +2590,61 @@ void refineDetectedMarkers(InputArray _image, Ptr<Board> &_board,
     }
     vector< int > recoveredIdxs; // original indexes of accepted markers in _rejectedCorners
 
-    // for each missing marker, try to find a correspondence
+    // corners of the rejected candidates, read once
+    int nRejected = (int)_rejectedCorners.total();
+    vector< Point2f > rejectedCorners(4 * nRejected);
+    for(int j = 0; j < nRejected; j++) {
+        Mat rejected = _rejectedCorners.getMat(j);
+        for(int c = 0; c < 4; c++)
+            rejectedCorners[4 * j + c] = rejected.ptr< Point2f >()[c];
+    }
+
+    // a candidate can only match a marker if all its corners are closer than the initial
+    // closestCandidateDistance, so its centroid is also closer than that distance
+    float maxMatchDistance = sqrt(minRepDistance * minRepDistance + 1.f);
+    CandidatesGrid rejectedGrid(rejectedCorners, maxMatchDistance);
+
+    // 1. parallel scoring: distances of every possible pairing of missing markers and candidates
+    double initialDistance = minRepDistance * minRepDistance + 1;
+    vector< vector< RefinePairing > > pairings(undetectedMarkersIds.size());
+    parallel_for_(Range(0, (int)undetectedMarkersIds.size()),
+                  RefinePairingParallel(&undetectedMarkersCorners, &rejectedCorners, &rejectedGrid,
+                                        initialDistance, checkAllOrders, &pairings));
+
+    // 2. parallel bit extraction of the candidates in any pairing. The bits are extracted without
+    // rotation and compared with the corresponding rotation of the marker code
+    int nbytes = (dictionary.markerSize * dictionary.markerSize + 8 - 1) / 8;
+    Mat rejectedBytes;
+    if(errorCorrectionRate >= 0) {
+        vector< char > needsBits(nRejected, 0);
+        for(unsigned int i = 0; i < pairings.size(); i++)
+            for(unsigned int p = 0; p < pairings[i].size(); p++)
+                needsBits[pairings[i][p].candidate] = 1;
+        vector< int > bitsCandidates;
+        for(int j = 0; j < nRejected; j++)
+            if(needsBits[j]) bitsCandidates.push_back(j);
+
+        rejectedBytes.create(nRejected, nbytes, CV_8UC1);
+        const MarkerKernels &kernels =
+            getMarkerKernels(dictionary.markerSize, params.markerBorderBits);
+        parallel_for_(Range(0, (int)bitsCandidates.size()),
+                      RefineExtractBitsParallel(&grey, &rejectedCorners, &bitsCandidates, &kernels,
+                                                dictionary.markerSize, &params, &rejectedBytes));
+    }
+
+    // 3. serial assignment, each missing marker takes its best candidate not taken by the
+    // previous markers
+    vector< Mat > recoveredCorners;
     for(unsigned int i = 0; i < undetectedMarkersIds.size(); i++) {
 
         // best match at the moment
         int closestCandidateIdx = -1;
-        double closestCandidateDistance = minRepDistance * minRepDistance + 1;
-        Mat closestRotatedMarker;
+        double closestCandidateDistance = initialDistance;
+        int closestRotation = 0;
 
-        for(unsigned int j = 0; j < _rejectedCorners.total(); j++) {
+        for(unsigned int p = 0; p < pairings[i].size(); p++) {
+            const RefinePairing &pairing = pairings[i][p];
+            int j = pairing.candidate;
             if(alreadyIdentified[j]) continue;
 
             // check distance
@@ -1163,81 +2652,51 @@ void refineDetectedMarkers(InputArray _image, Ptr<Board> &_board,
             bool valid = false;
             int validRot = 0;
             for(int c = 0; c < 4; c++) { // first corner in rejected candidate
-                double currentMaxDistance = 0;
-                for(int k = 0; k < 4; k++) {
-                    Point2f rejCorner = _rejectedCorners.getMat(j).ptr< Point2f >()[(c + k) % 4];
-                    Point2f distVector = undetectedMarkersCorners[i][k] - rejCorner;
-                    double cornerDist = distVector.x * distVector.x + distVector.y * distVector.y;
-                    currentMaxDistance = max(currentMaxDistance, cornerDist);
-                }
                 // if distance is better than current best distance
-                if(currentMaxDistance < closestCandidateDistance) {
+                if(pairing.distances[c] < closestCandidateDistance) {
                     valid = true;
                     validRot = c;
-                    minDistance = currentMaxDistance;
+                    minDistance = pairing.distances[c];
                 }
                 if(!checkAllOrders) break;
             }
 
             if(!valid) continue;
 
-            // apply rotation
-            Mat rotatedMarker;
-            if(checkAllOrders) {
-                rotatedMarker = Mat(4, 1, CV_32FC2);
-                for(int c = 0; c < 4; c++)
-                    rotatedMarker.ptr< Point2f >()[c] =
-                        _rejectedCorners.getMat(j).ptr< Point2f >()[(c + 4 + validRot) % 4];
-            }
-            else rotatedMarker = _rejectedCorners.getMat(j);
-
             // last filter, check if inner code is close enough to the assigned marker code
             int codeDistance = 0;
             // if errorCorrectionRate, dont check code
             if(errorCorrectionRate >= 0) {
-
-                // extract bits
-                Mat bits = _extractBits(
-                    grey, rotatedMarker, dictionary.markerSize, params.markerBorderBits,
-                    params.perspectiveRemovePixelPerCell,
-                    params.perspectiveRemoveIgnoredMarginPerCell, params.minOtsuStdDev);
-
-                Mat onlyBits =
-                    bits.rowRange(params.markerBorderBits, bits.rows - params.markerBorderBits)
-                        .colRange(params.markerBorderBits, bits.rows - params.markerBorderBits);
-
-                codeDistance =
-                    dictionary.getDistanceToId(onlyBits, undetectedMarkersIds[i], false);
+                // the bits of the candidate rotated by validRot are the bits of the candidate
+                // compared with the marker code rotated in the opposite direction
+                int codeRotation = (4 - validRot) % 4;
+                codeDistance = cv::hal::normHamming(
+                    dictionary.bytesList.ptr(undetectedMarkersIds[i]) + codeRotation * nbytes,
+                    rejectedBytes.ptr(j), nbytes);
             }
 
             // if everythin is ok, assign values to current best match
             if(errorCorrectionRate < 0 || codeDistance < maxCorrectionRecalculated) {
                 closestCandidateIdx = j;
                 closestCandidateDistance = minDistance;
-                closestRotatedMarker = rotatedMarker;
+                closestRotation = validRot;
             }
         }
 
         // if at least one good match, we have rescue the missing marker
         if(closestCandidateIdx >= 0) {
 
-            // subpixel refinement
-            if(params.doCornerRefinement) {
-                CV_Assert(params.cornerRefinementWinSize > 0 &&
-                          params.cornerRefinementMaxIterations > 0 &&
-                          params.cornerRefinementMinAccuracy > 0);
-                cornerSubPix(grey, closestRotatedMarker,
-                             Size(params.cornerRefinementWinSize, params.cornerRefinementWinSize),
-                             Size(-1, -1), TermCriteria(TermCriteria::MAX_ITER | TermCriteria::EPS,
-                                                        params.cornerRefinementMaxIterations,
-                                                        params.cornerRefinementMinAccuracy));
-            }
+            // apply rotation
+            Mat closestRotatedMarker(4, 1, CV_32FC2);
+            for(int c = 0; c < 4; c++)
+                closestRotatedMarker.ptr< Point2f >()[c] =
+                    rejectedCorners[4 * closestCandidateIdx + (c + 4 + closestRotation) % 4];
 
             // remove from rejected
             alreadyIdentified[closestCandidateIdx] = true;
 
             // add to detected
-            finalAcceptedCorners.push_back(closestRotatedMarker);
+            recoveredCorners.push_back(closestRotatedMarker);
             finalAcceptedIds.push_back(undetectedMarkersIds[i]);
 
             // add the original index of the candidate
@@ -1245,6 +2704,15 @@ void refineDetectedMarkers(InputArray _image, Ptr<Board> &_board,
         }
     }
 
+    // 4. subpixel refinement of all the recovered markers in one parallel batch
+    if(params.doCornerRefinement && !recoveredCorners.empty()) {
+        CV_Assert(params.cornerRefinementWinSize > 0 && params.cornerRefinementMaxIterations > 0 &&
+                  params.cornerRefinementMinAccuracy > 0);
+        _refineCornersSubpix(grey, recoveredCorners, params);
+    }
+    finalAcceptedCorners.insert(finalAcceptedCorners.end(), recoveredCorners.begin(),
+                                recoveredCorners.end());
+
     // parse output
     if(finalAcceptedIds.size() != _detectedIds.total()) {
         _detectedCorners.clear();
@@ -1321,6 +2789,84 @@ int estimatePoseBoard(InputArrayOfArrays _corners, InputArray _ids, Ptr<Board> &
 
 
 
+/**
+  */
+BoardPoseEstimator::BoardPoseEstimator(const Ptr<Board> &_board, double _maxReprojectionError)
+    : board(_board), maxReprojectionError(_maxReprojectionError), validPose(false) {
+
+    CV_Assert(!board.empty() && board->ids.size() == board->objPoints.size());
+    CV_Assert(maxReprojectionError >= 0);
+}
+
+
+/**
+  * @brief Create a new board pose estimator
+  */
+Ptr<BoardPoseEstimator> BoardPoseEstimator::create(const Ptr<Board> &board,
+                                                   double maxReprojectionError) {
+    return makePtr<BoardPoseEstimator>(board, maxReprojectionError);
+}
+
+
+/**
+  */
+int BoardPoseEstimator::estimate(InputArrayOfArrays _corners, InputArray _ids,
+                                 InputArray _cameraMatrix, InputArray _distCoeffs,
+                                 OutputArray _rvec, OutputArray _tvec) {
+
+    CV_Assert(_corners.total() == _ids.total());
+
+    // get object and image points for the solvePnP function
+    Mat ids = _ids.getMat();
+    int nDetectedMarkers = (int)_ids.total();
+    objPoints.clear();
+    imgPoints.clear();
+    BoardMarkerLookup boardMarkers(*board);
+    for(int i = 0; i < nDetectedMarkers; i++) {
+        int markerIdx = boardMarkers.first(ids.ptr< int >(0)[i]);
+        if(markerIdx < 0) continue;
+        const Point2f *corners = _corners.getMat(i).ptr< Point2f >(0);
+        for(; markerIdx >= 0; markerIdx = boardMarkers.next(markerIdx)) {
+            for(int p = 0; p < 4; p++) {
+                objPoints.push_back(board->objPoints[markerIdx][p]);
+                imgPoints.push_back(corners[p]);
+            }
+        }
+    }
+
+    if(objPoints.empty()) { // 0 of the detected markers in board
+        validPose = false;
+        return 0;
+    }
+
+    bool solve = true;
+    if(validPose) {
+        // keep the previous pose if it still explains the detected corners
+        projectPoints(objPoints, rvec, tvec, _cameraMatrix, _distCoeffs, projectedPoints);
+        double sqError = 0;
+        for(unsigned int i = 0; i < imgPoints.size(); i++) {
+            Point2f diff = projectedPoints[i] - imgPoints[i];
+            sqError += diff.x * diff.x + diff.y * diff.y;
+        }
+        solve = sqError > maxReprojectionError * maxReprojectionError * imgPoints.size();
+    }
+
+    if(solve) {
+        rvec.create(3, 1, CV_64FC1);
+        tvec.create(3, 1, CV_64FC1);
+        solvePnP(objPoints, imgPoints, _cameraMatrix, _distCoeffs, rvec, tvec, validPose);
+        validPose = true;
+    }
+
+    rvec.copyTo(_rvec);
+    tvec.copyTo(_tvec);
+
+    // divide by four since all the four corners are concatenated in the array for each marker
+    return (int)objPoints.size() / 4;
+}
+
+
+
 
 /**
  */
@@ -1329,6 +2875,54 @@ void GridBoard::draw(Size outSize, OutputArray _img, int marginSize, int borderB
 }
 
 
+/**
+  */
+Ptr<Board> Board::create(InputArrayOfArrays _objPoints, Ptr<Dictionary> &dictionary,
+                         InputArray _ids) {
+
+    CV_Assert(_objPoints.total() == _ids.total());
+
+    Ptr<Board> res = makePtr<Board>();
+    res->dictionary = dictionary;
+
+    Mat ids = _ids.getMat();
+    int nMarkers = (int)_objPoints.total();
+    res->ids.resize(nMarkers);
+    res->objPoints.resize(nMarkers);
+    for(int i = 0; i < nMarkers; i++) {
+        Mat corners = _objPoints.getMat(i);
+        CV_Assert(corners.total() == 4 && corners.type() == CV_32FC3);
+        res->ids[i] = ids.ptr< int >(0)[i];
+        res->objPoints[i].assign(corners.ptr< Point3f >(0), corners.ptr< Point3f >(0) + 4);
+    }
+
+    res->updateIdIndex();
+    return res;
+}
+
+
+/**
+  */
+void Board::updateIdIndex() {
+
+    int maxId = -1;
+    for(unsigned int j = 0; j < ids.size(); j++) {
+        CV_Assert(ids[j] >= 0);
+        maxId = max(maxId, ids[j]);
+    }
+
+    // markers with a repeated id are chained from the first one
+    _idIndex.assign(maxId + 1, -1);
+    _nextIndex.resize(ids.size());
+    for(int j = (int)ids.size() - 1; j >= 0; j--) {
+        _nextIndex[j] = _idIndex[ids[j]];
+        _idIndex[ids[j]] = j;
+    }
+    _indexedIds = ids;
+}
+
+
+
 /**
  */
 Ptr<GridBoard> GridBoard::create(int markersX, int markersY, float markerLength, float markerSeparation,
@@ -1368,6 +2962,7 @@ Ptr<GridBoard> GridBoard::create(int markersX, int markersY, float markerLength,
         }
     }
 
+    res->updateIdIndex();
     return res;
 }
 
@@ -1599,5 +3194,210 @@ double calibrateCameraAruco(InputArrayOfArrays _corners, InputArray _ids, InputA
 
 
 
+// size of the grid of image cells used to measure the coverage of the calibration views
+static const int CALIBRATION_COVERAGE_GRID = 8;
+
+
+/**
+  */
+IncrementalCalibrator::IncrementalCalibrator(const Ptr<Board> &_board, Size _imageSize,
+                                             int _flags, TermCriteria _criteria)
+    : board(_board), imageSize(_imageSize), flags(_flags), criteria(_criteria),
+      coverage(CALIBRATION_COVERAGE_GRID, CALIBRATION_COVERAGE_GRID, CV_32SC1, Scalar::all(0)),
+      calibrated(false), reprojectionError(0) {
+
+    CV_Assert(!board.empty() && imageSize.width > 0 && imageSize.height > 0);
+}
+
+
+/**
+  * @brief Create a new incremental calibrator
+  */
+Ptr<IncrementalCalibrator> IncrementalCalibrator::create(const Ptr<Board> &board, Size imageSize,
+                                                         int flags, TermCriteria criteria) {
+    return makePtr<IncrementalCalibrator>(board, imageSize, flags, criteria);
+}
+
+
+/**
+  */
+void IncrementalCalibrator::getViewPoints(InputArrayOfArrays _corners, InputArray _ids,
+                                          Mat &objPoints, Mat &imgPoints) const {
+
+    Ptr<Board> viewBoard = board;
+    _getBoardObjectAndImagePoints(viewBoard, _ids, _corners, imgPoints, objPoints);
+}
+
+
+/**
+  */
+int IncrementalCalibrator::addFrame(InputArrayOfArrays _corners, InputArray _ids) {
+
+    CV_Assert(_corners.total() == _ids.total());
+
+    Mat objPoints, imgPoints;
+    getViewPoints(_corners, _ids, objPoints, imgPoints);
+    if(imgPoints.total() == 0) return 0;
+
+    objectPoints.push_back(objPoints);
+    imagePoints.push_back(imgPoints);
+
+    const Point2f *points = imgPoints.ptr< Point2f >(0);
+    for(size_t i = 0; i < imgPoints.total(); i++) {
+        int cx = min(max(int(points[i].x * CALIBRATION_COVERAGE_GRID / imageSize.width), 0),
+                     CALIBRATION_COVERAGE_GRID - 1);
+        int cy = min(max(int(points[i].y * CALIBRATION_COVERAGE_GRID / imageSize.height), 0),
+                     CALIBRATION_COVERAGE_GRID - 1);
+        coverage.at< int >(cy, cx)++;
+    }
+
+    // divide by four since all the four corners are concatenated in the array for each marker
+    return (int)imgPoints.total() / 4;
+}
+
+
+/**
+  */
+double IncrementalCalibrator::calibrate() {
+
+    CV_Assert(!objectPoints.empty());
+
+    reprojectionError = calibrateCamera(objectPoints, imagePoints, imageSize, cameraMatrix,
+                                        distCoeffs, rvecs, tvecs, flags, criteria);
+    calibrated = true;
+    return reprojectionError;
+}
+
+
+/**
+  */
+double IncrementalCalibrator::refine(int maxIterations, int maxFrames) {
+
+    CV_Assert(maxIterations > 0 && maxFrames > 0);
+    if(!calibrated) return calibrate();
+
+    int nFrames = (int)objectPoints.size();
+    int nRefined = min(nFrames, maxFrames);
+
+    // frames of the joint optimization, evenly spread and always including the first and the
+    // last one
+    vector< int > refinedFrames(nRefined);
+    vector< bool > isRefined(nFrames, false);
+    for(int k = 0; k < nRefined; k++) {
+        refinedFrames[k] = nRefined == 1 ? nFrames - 1
+                                         : (int)((int64)k * (nFrames - 1) / (nRefined - 1));
+        isRefined[refinedFrames[k]] = true;
+    }
+
+    vector< Mat > refinedObjectPoints(nRefined), refinedImagePoints(nRefined);
+    for(int k = 0; k < nRefined; k++) {
+        refinedObjectPoints[k] = objectPoints[refinedFrames[k]];
+        refinedImagePoints[k] = imagePoints[refinedFrames[k]];
+    }
+
+    TermCriteria refineCriteria(TermCriteria::COUNT + TermCriteria::EPS, maxIterations,
+                                criteria.epsilon);
+    vector< Mat > refinedRvecs, refinedTvecs;
+    calibrateCamera(refinedObjectPoints, refinedImagePoints, imageSize, cameraMatrix, distCoeffs,
+                    refinedRvecs, refinedTvecs, flags | CALIB_USE_INTRINSIC_GUESS,
+                    refineCriteria);
+
+    // poses of the other frames with the new intrinsics, from their previous pose if they have
+    // one, i.e. if they were added before the last calibration
+    rvecs.resize(nFrames);
+    tvecs.resize(nFrames);
+    for(int k = 0; k < nRefined; k++) {
+        rvecs[refinedFrames[k]] = refinedRvecs[k];
+        tvecs[refinedFrames[k]] = refinedTvecs[k];
+    }
+    for(int v = 0; v < nFrames; v++) {
+        if(isRefined[v]) continue;
+        bool hasPose = !rvecs[v].empty();
+        solvePnP(objectPoints[v], imagePoints[v], cameraMatrix, distCoeffs, rvecs[v], tvecs[v],
+                 hasPose);
+    }
+
+    // re-projection error over all the frames, as returned by calibrateCamera
+    double squaredErrorSum = 0;
+    size_t nPoints = 0;
+    vector< Point2f > projectedPoints;
+    for(int v = 0; v < nFrames; v++) {
+        projectPoints(objectPoints[v], rvecs[v], tvecs[v], cameraMatrix, distCoeffs,
+                      projectedPoints);
+        double error = norm(Mat(projectedPoints), imagePoints[v], NORM_L2);
+        squaredErrorSum += error * error;
+        nPoints += projectedPoints.size();
+    }
+    reprojectionError = sqrt(squaredErrorSum / (double)nPoints);
+    return reprojectionError;
+}
+
+
+/**
+  */
+double IncrementalCalibrator::getViewGain(InputArrayOfArrays _corners, InputArray _ids) const {
+
+    CV_Assert(_corners.total() == _ids.total());
+
+    Mat objPoints, imgPoints;
+    getViewPoints(_corners, _ids, objPoints, imgPoints);
+    if(imgPoints.total() == 0) return 0;
+
+    // coverage, each point counts less the more points have been observed in its cell
+    double coverageGain = 0;
+    const Point2f *points = imgPoints.ptr< Point2f >(0);
+    for(size_t i = 0; i < imgPoints.total(); i++) {
+        int cx = min(max(int(points[i].x * CALIBRATION_COVERAGE_GRID / imageSize.width), 0),
+                     CALIBRATION_COVERAGE_GRID - 1);
+        int cy = min(max(int(points[i].y * CALIBRATION_COVERAGE_GRID / imageSize.height), 0),
+                     CALIBRATION_COVERAGE_GRID - 1);
+        coverageGain += 1. / (1. + coverage.at< int >(cy, cx));
+    }
+    coverageGain /= (double)imgPoints.total();
+
+    // pose novelty, angle between the board normal and the closest normal of the added views
+    double poseGain = 1;
+    if(calibrated) {
+        Mat rvec, tvec;
+        solvePnP(objPoints, imgPoints, cameraMatrix, distCoeffs, rvec, tvec);
+        Mat R;
+        Rodrigues(rvec, R);
+        Vec3d normal(R.at< double >(0, 2), R.at< double >(1, 2), R.at< double >(2, 2));
+
+        double maxCos = -1;
+        for(unsigned int v = 0; v < rvecs.size(); v++) {
+            Mat Rv;
+            Rodrigues(rvecs[v], Rv);
+            double cosAngle = normal[0] * Rv.at< double >(0, 2) +
+                              normal[1] * Rv.at< double >(1, 2) +
+                              normal[2] * Rv.at< double >(2, 2);
+            maxCos = max(maxCos, cosAngle);
+        }
+        // 45 degrees or more from every added view is considered completely new
+        double angle = acos(min(max(maxCos, -1.), 1.));
+        poseGain = min(angle / (CV_PI / 4.), 1.);
+    }
+
+    return 0.5 * (coverageGain + poseGain);
+}
+
+
+/**
+  */
+void IncrementalCalibrator::getExtrinsics(OutputArrayOfArrays _rvecs,
+                                          OutputArrayOfArrays _tvecs) const {
+
+    _rvecs.create((int)rvecs.size(), 1, CV_64FC3);
+    _tvecs.create((int)tvecs.size(), 1, CV_64FC3);
+    for(unsigned int i = 0; i < rvecs.size(); i++) {
+        _rvecs.create(3, 1, CV_64F, i, true);
+        rvecs[i].copyTo(_rvecs.getMat(i));
+        _tvecs.create(3, 1, CV_64F, i, true);
+        tvecs[i].copyTo(_tvecs.getMat(i));
+    }
+}
+
+
+
 }
 }
\ No newline at end of file
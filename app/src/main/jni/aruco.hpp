@@ -78,6 +78,16 @@ namespace aruco {
 
 
 
+/**
+ * @brief Corner refinement methods
+ */
+enum CornerRefineMethod {
+    CORNER_REFINE_SUBPIX,  ///< iterative refinement over the image gradient, as cornerSubPix
+    CORNER_REFINE_CONTOUR  ///< intersection of the lines fitted to the edges of the contour
+};
+
+
+
 /**
  * @brief Parameters for the detectMarker process:
  * - adaptiveThreshWinSizeMin: minimum window size for adaptive thresholding before finding
@@ -101,6 +111,13 @@ namespace aruco {
  *   similar, so that the smaller one is removed. The rate is relative to the smaller perimeter
  *   of the two markers (default 0.05).
  * - doCornerRefinement: do subpixel refinement or not
+ * - cornerRefinementMethod: corner refinement method, one of CornerRefineMethod. The contour
+ *   method reuses the contour found during the candidate detection and does not iterate over the
+ *   image. Markers recovered by refineDetectedMarkers have no contour and always use
+ *   CORNER_REFINE_SUBPIX (default CORNER_REFINE_SUBPIX).
+ * - cornerRefinementContourEdgeSampling: with CORNER_REFINE_CONTOUR, move each contour point
+ *   to the position of maximum grey level gradient across the edge before fitting the lines
+ *   (default true).
  * - cornerRefinementWinSize: window size for the corner refinement process (in pixels) (default 5).
  * - cornerRefinementMaxIterations: maximum number of iterations for stop criteria of the corner
  *   refinement process (default 30).
@@ -120,6 +137,9 @@ namespace aruco {
  *   than 128 or not) (default 5.0)
  * - errorCorrectionRate error correction rate respect to the maximun error correction capability
  *   for each dictionary. (default 0.6).
+ * - allowedIds: if not empty, only these marker ids are identified, the rest of the dictionary
+ *   is ignored (@sa Dictionary::createView). A list in increasing order is used in place, other
+ *   lists are sorted on each call (default empty, all the ids).
  */
 struct CV_EXPORTS_W DetectorParameters {
 
@@ -138,6 +158,8 @@ struct CV_EXPORTS_W DetectorParameters {
     CV_PROP_RW int minDistanceToBorder;
     CV_PROP_RW double minMarkerDistanceRate;
     CV_PROP_RW bool doCornerRefinement;
+    CV_PROP_RW int cornerRefinementMethod;
+    CV_PROP_RW bool cornerRefinementContourEdgeSampling;
     CV_PROP_RW int cornerRefinementWinSize;
     CV_PROP_RW int cornerRefinementMaxIterations;
     CV_PROP_RW double cornerRefinementMinAccuracy;
@@ -147,6 +169,102 @@ struct CV_EXPORTS_W DetectorParameters {
     CV_PROP_RW double maxErroneousBitsInBorderRate;
     CV_PROP_RW double minOtsuStdDev;
     CV_PROP_RW double errorCorrectionRate;
+    CV_PROP_RW std::vector< int > allowedIds;
+};
+
+
+
+/**
+ * @brief Cache of marker identifications between consecutive frames
+ *
+ * The same physical markers appear in almost the same position on consecutive frames. The cache
+ * remembers the id and rotation of the markers identified in previous frames, indexed by the
+ * approximate position (center) and size (mean side length) of their quad. When a new candidate
+ * falls on a cached entry, only the center pixel of each marker cell is sampled and compared
+ * against the cached code in its cached rotation, instead of removing the perspective of the
+ * whole candidate and searching the four rotations of the complete dictionary. Entries whose verification fails are invalidated and the
+ * candidate follows the normal identification process.
+ *
+ * - capacity: maximum number of cached markers. When full, the least recently seen entry is
+ *   replaced (default 64).
+ * - positionTolerance: maximum distance between a candidate center and a cached center to be
+ *   considered the same marker, as a rate respect to the cached size (default 0.25).
+ * - sizeTolerance: maximum difference between a candidate size and a cached size, as a rate
+ *   respect to the cached size (default 0.2).
+ *
+ * A cache must not be shared by concurrent calls to detectMarkers.
+ */
+class CV_EXPORTS_W IdentificationCache {
+
+    public:
+    struct Entry {
+        Point2f center;
+        float size;
+        int id;
+        int rotation;
+        int lastFrame; // last frame where the entry was identified or verified
+        bool valid;
+    };
+
+    IdentificationCache(int capacity = 64, float positionTolerance = 0.25f,
+                        float sizeTolerance = 0.2f);
+
+    CV_WRAP static Ptr<IdentificationCache> create(int capacity = 64,
+                                                   float positionTolerance = 0.25f,
+                                                   float sizeTolerance = 0.2f);
+
+    /**
+     * @brief Start a new frame, called once per detectMarkers call
+     */
+    void nextFrame();
+
+    /**
+     * @brief Returns the index of the valid entry matching the given quad center and size, or -1
+     */
+    int find(Point2f center, float size) const;
+
+    /**
+     * @brief Store the identification of a quad, replacing the entry in the same position, a free
+     * entry or the least recently seen one, in this order
+     */
+    void insert(Point2f center, float size, int id, int rotation);
+
+    /**
+     * @brief Refresh an entry whose verification succeeded in the current frame
+     */
+    void update(int entryIdx, Point2f center, float size, int rotation);
+
+    /**
+     * @brief Invalidate an entry whose verification failed
+     */
+    void invalidate(int entryIdx);
+
+    /**
+     * @brief Remove all the entries. Statistics are kept
+     */
+    void clear();
+
+    const Entry &getEntry(int entryIdx) const { return entries[entryIdx]; }
+
+    /**
+     * @brief Statistics of the cache usage since creation or the last resetStats() call
+     * - lookups: number of candidates searched in the cache
+     * - hits: number of candidates identified by the cheap verification
+     * - invalidations: number of found entries whose verification failed
+     */
+    void addStats(int lookups, int hits, int invalidations);
+    void resetStats();
+    int getLookups() const { return _lookups; }
+    int getHits() const { return _hits; }
+    int getInvalidations() const { return _invalidations; }
+    double getHitRate() const { return _lookups > 0 ? double(_hits) / double(_lookups) : 0.; }
+
+    private:
+    std::vector< Entry > entries;
+    int _capacity;
+    float _positionTolerance, _sizeTolerance;
+    int _frame;
+    int _lookups, _hits, _invalidations;
 };
 
 
@@ -165,6 +283,8 @@ struct CV_EXPORTS_W DetectorParameters {
  * @param parameters marker detection parameters
  * @param rejectedImgPoints contains the imgPoints of those squares whose inner code has not a
  * correct codification. Useful for debugging purposes.
+ * @param identificationCache optional cache of the markers identified in previous frames
+ * (@sa IdentificationCache). It is updated with the markers identified in this image.
  *
  * Performs marker detection in the input image. Only markers included in the specific dictionary
  * are searched. For each detected marker, it returns the 2D position of its corner in the image
@@ -175,7 +295,8 @@ struct CV_EXPORTS_W DetectorParameters {
  */
 CV_EXPORTS_W void detectMarkers(InputArray image, Ptr<Dictionary> &dictionary, OutputArrayOfArrays corners,
                                 OutputArray ids, const Ptr<DetectorParameters> &parameters = DetectorParameters::create(),
-                                OutputArrayOfArrays rejectedImgPoints = noArray());
+                                OutputArrayOfArrays rejectedImgPoints = noArray(),
+                                const Ptr<IdentificationCache> &identificationCache = Ptr<IdentificationCache>());
 
 
 
@@ -213,6 +334,35 @@ CV_EXPORTS_W void estimatePoseSingleMarkers(InputArrayOfArrays corners, float ma
 
 
 
+/**
+ * @brief Pose estimation for single markers with an analytic planar solver over flat arrays
+ *
+ * @param corners array of 4 * nMarkers corners, the four corners of each marker consecutive and
+ * in the same order than in detectMarkers.
+ * @param nMarkers number of markers
+ * @param markerLength the length of the markers' side.
+ * @param cameraMatrix input 3x3 floating-point camera matrix
+ * @param distCoeffs vector of distortion coefficients
+ * @param rvecs array of nMarkers output rotation vectors.
+ * @param tvecs array of nMarkers output translation vectors.
+ * @param useExtrinsicGuess if true, rvecs and tvecs contain the poses of the same markers in
+ * the previous frame. A planar square has two poses that explain its corners almost equally well
+ * when it is small or seen from the front; in that case the one closest to the previous pose is
+ * returned, which avoids pose flips between frames. Markers with a null previous tvec are solved
+ * without guess.
+ *
+ * This is the solver used by estimatePoseSingleMarkers. The pose of each marker is obtained in
+ * closed form with IPPE (T. Collins and A. Bartoli, "Infinitesimal Plane-Based Pose Estimation",
+ * IJCV 2014) from the homography between the marker and its corners, instead of the iterative
+ * solvePnP. All the corners are undistorted in a single call.
+ */
+CV_EXPORTS void estimatePoseSingleMarkersIPPE(const Point2f *corners, int nMarkers,
+                                              float markerLength, InputArray cameraMatrix,
+                                              InputArray distCoeffs, Vec3d *rvecs, Vec3d *tvecs,
+                                              bool useExtrinsicGuess = false);
+
+
+
 /**
  * @brief Board of markers
  *
@@ -236,6 +386,67 @@ class CV_EXPORTS_W Board {
     // vector of the identifiers of the markers in the board (same size than objPoints)
     // The identifiers refers to the board dictionary
     std::vector< int > ids;
+
+    /**
+     * @brief Create a Board object from its markers
+     *
+     * @param objPoints array of object points of all the marker corners in the board, Mx4
+     * @param dictionary the dictionary of markers employed for this board
+     * @param ids vector of the identifiers of the markers in the board, size M
+     */
+    CV_WRAP static Ptr<Board> create(InputArrayOfArrays objPoints, Ptr<Dictionary> &dictionary,
+                                     InputArray ids);
+
+    /**
+     * @brief Index of the first marker with an id in ids and objPoints, or -1 if the marker is not
+     * in the board
+     *
+     * The lookup uses a dense table from id to index, built by create(), GridBoard::create() and
+     * updateIdIndex(), and only valid while isIdIndexValid(). The table is never rebuilt by the
+     * lookups, so concurrent lookups on the same board are safe. The board functions of this
+     * module check the table once per call and scan ids when it is not valid, so boards filled by
+     * hand do not need the table.
+     */
+    int getMarkerIndex(int id) const {
+        if(id < 0 || id >= (int)_idIndex.size()) return -1;
+        int index = _idIndex[id];
+        return index < (int)ids.size() ? index : -1;
+    }
+
+    /**
+     * @brief Index of the next marker with the same id than the marker at index, or -1
+     *
+     * Only needed by boards that repeat ids, all the markers with an id are visited with
+     * for(int j = getMarkerIndex(id); j >= 0; j = getNextMarkerIndex(j)).
+     */
+    int getNextMarkerIndex(int index) const {
+        if(index < 0 || index >= (int)_nextIndex.size()) return -1;
+        int next = _nextIndex[index];
+        return next < (int)ids.size() ? next : -1;
+    }
+
+    /**
+     * @brief True if the table from marker id to index was built from the current ids
+     */
+    bool isIdIndexValid() const {
+        return _indexedIds == ids;
+    }
+
+    /**
+     * @brief Rebuild the table from marker id to index, after ids has been modified
+     */
+    void updateIdIndex();
+
+    private:
+    // dense table from marker id to the index of its first marker in ids, -1 for the ids not in
+    // the board
+    std::vector< int > _idIndex;
+
+    // for each marker, index of the next marker with the same id, -1 for the last one
+    std::vector< int > _nextIndex;
+
+    // ids when the table was built
+    std::vector< int > _indexedIds;
 };
 
 
@@ -340,6 +551,57 @@ CV_EXPORTS_W int estimatePoseBoard(InputArrayOfArrays corners, InputArray ids, P
 
 
 
+/**
+ * @brief Stateful pose estimation of a board along a video sequence
+ *
+ * Equivalent to estimatePoseBoard, but keeps the pose of the previous frame between calls. If the
+ * detected corners are reprojected with the previous pose with a RMS error lower than
+ * maxReprojectionError (in pixels), the previous pose is returned without solving. Otherwise it is
+ * used as extrinsic guess of solvePnP, so that only a few iterations are needed when the board
+ * moves. The buffers of object and image points are also reused between frames.
+ */
+class CV_EXPORTS_W BoardPoseEstimator {
+
+    public:
+    BoardPoseEstimator(const Ptr<Board> &board, double maxReprojectionError = 0.5);
+
+    CV_WRAP static Ptr<BoardPoseEstimator> create(const Ptr<Board> &board,
+                                                  double maxReprojectionError = 0.5);
+
+    /**
+     * @brief Estimate the pose of the board in a new frame
+     *
+     * Same parameters and return value than estimatePoseBoard. The camera parameters should not
+     * change between calls. If no marker of the board is detected, the previous pose is
+     * forgotten and the next call solves from scratch.
+     */
+    CV_WRAP int estimate(InputArrayOfArrays corners, InputArray ids, InputArray cameraMatrix,
+                         InputArray distCoeffs, OutputArray rvec, OutputArray tvec);
+
+    /**
+     * @brief Forget the previous pose, the next estimation is solved from scratch
+     */
+    CV_WRAP void reset() { validPose = false; }
+
+    /**
+     * @brief Whether the next estimation will use the previous pose
+     */
+    CV_WRAP bool hasPose() const { return validPose; }
+
+    private:
+    Ptr<Board> board;
+    double maxReprojectionError;
+
+    bool validPose;
+    Mat rvec, tvec;
+
+    // buffers reused between frames
+    std::vector< Point3f > objPoints;
+    std::vector< Point2f > imgPoints, projectedPoints;
+};
+
+
+
 
 /**
  * @brief Refind not detected markers based on the already detected and the board layout
@@ -506,6 +768,108 @@ CV_EXPORTS_W double calibrateCameraAruco(
 
 
 
+/**
+ * @brief Camera calibration with aruco boards, adding the views one at a time
+ *
+ * Equivalent to calibrateCameraAruco for live capture. The object and image points of each frame
+ * are obtained once, when the frame is added, and kept until the calibrator is destroyed.
+ * calibrate() runs the complete calibration over all the frames, while refine() starts from the
+ * current intrinsics (CALIB_USE_INTRINSIC_GUESS) with a few iterations over a bounded number of
+ * frames, so it can run after each new frame. getViewGain() scores how much a detection would add
+ * to the current set of views, to decide which frames are worth adding.
+ */
+class CV_EXPORTS_W IncrementalCalibrator {
+
+    public:
+    /**
+     * @param board Marker Board layout
+     * @param imageSize Size of the image used only to initialize the intrinsic camera matrix.
+     * @param flags flags Different flags for the calibration process (@sa calibrateCamera)
+     * @param criteria Termination criteria for calibrate()
+     */
+    IncrementalCalibrator(const Ptr<Board> &board, Size imageSize, int flags = 0,
+                          TermCriteria criteria = TermCriteria(TermCriteria::COUNT +
+                                                                   TermCriteria::EPS,
+                                                               30, DBL_EPSILON));
+
+    CV_WRAP static Ptr<IncrementalCalibrator> create(
+        const Ptr<Board> &board, Size imageSize, int flags = 0,
+        TermCriteria criteria = TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 30,
+                                             DBL_EPSILON));
+
+    /**
+     * @brief Add the markers detected in a new view of the board
+     *
+     * @param corners detected marker corners, with the format returned by detectMarkers
+     * @param ids identifiers of the detected markers
+     *
+     * Returns the number of markers of the board in the view. Views without markers of the
+     * board are not added.
+     */
+    CV_WRAP int addFrame(InputArrayOfArrays corners, InputArray ids);
+
+    /**
+     * @brief Complete calibration over all the frames added, returns the re-projection error
+     */
+    CV_WRAP double calibrate();
+
+    /**
+     * @brief Calibration starting from the current intrinsics with at most maxIterations
+     * iterations. Calls calibrate() if there is no previous calibration.
+     *
+     * The joint optimization of calibrateCamera grows with the cube of the number of views, so it
+     * only uses maxFrames of them: the last added frame and the others evenly spread over the
+     * previous ones. The poses of the remaining views are then updated with solvePnP from their
+     * previous pose, which is still linear in the number of frames but cheap. Returns the
+     * re-projection error over all the frames.
+     */
+    CV_WRAP double refine(int maxIterations = 5, int maxFrames = 20);
+
+    /**
+     * @brief Estimated information added by a view, between 0 and 1, without adding it
+     *
+     * Mean of two terms: the image coverage, i.e. how many of the view corners fall on image
+     * regions with few observations in the added frames, and the pose novelty, i.e. the angle
+     * between the board normal in the view and the closest board normal of the added frames.
+     * The pose novelty needs a previous calibration, before that it is 1.
+     */
+    CV_WRAP double getViewGain(InputArrayOfArrays corners, InputArray ids) const;
+
+    CV_WRAP int getFramesCount() const { return (int)objectPoints.size(); }
+    CV_WRAP bool isCalibrated() const { return calibrated; }
+    CV_WRAP double getReprojectionError() const { return reprojectionError; }
+    CV_WRAP Mat getCameraMatrix() const { return cameraMatrix; }
+    CV_WRAP Mat getDistCoeffs() const { return distCoeffs; }
+
+    /**
+     * @brief Board poses of the added frames in the last calibration
+     */
+    CV_WRAP void getExtrinsics(OutputArrayOfArrays rvecs, OutputArrayOfArrays tvecs) const;
+
+    private:
+    // object and image points of the board markers in a view
+    void getViewPoints(InputArrayOfArrays corners, InputArray ids, Mat &objPoints,
+                       Mat &imgPoints) const;
+
+    Ptr<Board> board;
+    Size imageSize;
+    int flags;
+    TermCriteria criteria;
+
+    // points of each added frame
+    std::vector< Mat > objectPoints, imagePoints;
+
+    // number of image points observed on each cell of a grid over the image
+    Mat coverage;
+
+    bool calibrated;
+    double reprojectionError;
+    Mat cameraMatrix, distCoeffs;
+    std::vector< Mat > rvecs, tvecs;
+};
+
+
+
 //! @}
 }
 }
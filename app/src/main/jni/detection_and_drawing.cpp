@@ -6,9 +6,15 @@
 #include "opencv2/core/affine.hpp"
 #include "opencv2/calib3d/calib3d.hpp"
 #include <vector>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <sstream>
+#include <thread>
 #include <android/log.h>
 #include "aruco.hpp"
+#include "frame_queue.hpp"
 
 #define APPNAME "CardboardKeyboard"
 #define SORTED_IDS_SIZE 17
@@ -17,6 +23,8 @@
 #define BOTTOM_RIGHT 2
 #define BOTTOM_LEFT 3
 #define KEYS_COUNT 49
+// Markers of the biggest supported keyboard, all the ids of the DICT_4X4_50 dictionary.
+#define MAX_MARKERS_COUNT 50
 
 using namespace std;
 using namespace cv;
@@ -41,49 +49,150 @@ string intToString(int num)
     return convert.str();
 }
 
-// Return vector which indexes are markerIds from 1 to n and its values are indexes of markerCorners.
-// Example: marker with id 4 was detected first, so sortedIds[4] == 0
+// Keyboard size, SORTED_IDS_SIZE and KEYS_COUNT by default. Set from Java with setKeyboardLayout,
+// the markers of the keyboard have ids from 0 to markersCount - 1.
+static atomic<int> keysCount(KEYS_COUNT);
+static atomic<int> markersCount(SORTED_IDS_SIZE);
+
+// Detected markers of the keyboard, in order of marker id.
+struct KeyboardLayout {
+    // Index in markerCorners of each detected marker, only the first detectedCount are valid.
+    array<int, MAX_MARKERS_COUNT> markerIndexes;
+    int detectedCount;
+    // Lowest detected marker id, needed to determine octave.
+    int minId;
+    int keysCount;
+};
+
+// Fill the keyboard layout from the detected markers.
+// Example: markers with ids 4 and 2 were detected in this order, so markerIndexes == {1, 0}
 // @param &markerIds Reference to vector of marker ID's.
-// @return Vector of marker ID's sorted by id.
-vector<int> getSortedIds(vector<int> &markerIds) {
-    // Initialize vector with fixed size and values -1.
-    vector<int> sortedIds(SORTED_IDS_SIZE, -1);
-    int i = 0;
-    int minId = SORTED_IDS_SIZE; // Lowest markerId, needed to determine octave.
-
-    for(vector<int>::iterator it = markerIds.begin(); it != markerIds.end(); it++) {
-        // Put markerId index as value and markerId as index to sortedIds.
-        if(*it < SORTED_IDS_SIZE){
-            sortedIds.at(*it) = i;
-        } else {
-            break;
-        }
-        ++i;
-        if(*it < minId) minId = *it;
+// @param keyboardMarkers Number of markers of the keyboard, ids out of it are skipped.
+// @param &layout Reference to the layout to fill.
+void getKeyboardLayout(const vector<int> &markerIds, int keyboardMarkers, KeyboardLayout &layout) {
+    // Index of each marker id, -1 if not detected.
+    array<int, MAX_MARKERS_COUNT> indexById;
+    indexById.fill(-1);
+
+    for(unsigned int i = 0; i < markerIds.size(); i++) {
+        if(markerIds[i] >= 0 && markerIds[i] < keyboardMarkers) indexById[markerIds[i]] = i;
     }
-    // Erase all unused elements(value == -1).
-    sortedIds.erase(remove(sortedIds.begin(), sortedIds.end(), -1), sortedIds.end());
 
-    // Store minimal ID for determining octave.
-    sortedIds.push_back(minId);
+    // Keep only the detected ids, still in order of id.
+    layout.detectedCount = 0;
+    layout.minId = keyboardMarkers;
+    for(int id = 0; id < keyboardMarkers; id++) {
+        if(indexById[id] < 0) continue;
+        if(layout.detectedCount == 0) layout.minId = id;
+        layout.markerIndexes[layout.detectedCount++] = indexById[id];
+    }
+}
 
-    return sortedIds;
+// Detector parameters that only identify the ids used by the keyboard, so stray markers
+// are rejected during the dictionary search.
+Ptr<DetectorParameters> createKeyboardDetectorParameters(int keyboardMarkers) {
+    Ptr<DetectorParameters> params = DetectorParameters::create();
+    for(int id = 0; id < keyboardMarkers; id++) params->allowedIds.push_back(id);
+    return params;
 }
 
-Scalar getColor(Color c) {
-    static Scalar colors[8];
-    colors[static_cast<int>(COLOR_TEXT)] = Scalar(0, 210, 0);
-    colors[static_cast<int>(COLOR_C)] = Scalar(239, 10, 0);
-    colors[static_cast<int>(COLOR_D)] = Scalar(0, 14, 239);
-    colors[static_cast<int>(COLOR_E)] = Scalar(250, 90, 7);
-    colors[static_cast<int>(COLOR_F)] = Scalar(240, 0, 230);
-    colors[static_cast<int>(COLOR_G)] = Scalar(240, 240, 0);
-    colors[static_cast<int>(COLOR_A)] = Scalar(117, 44, 0);
-    colors[static_cast<int>(COLOR_H)] = Scalar(0, 230, 240);
+// Return color of a note, chord or text.
+const Scalar &getColor(Color c) {
+    // Indexed by Color, initialized once.
+    static const Scalar colors[] = {
+        Scalar(239, 10, 0),   // COLOR_C
+        Scalar(0, 14, 239),   // COLOR_D
+        Scalar(250, 90, 7),   // COLOR_E
+        Scalar(240, 0, 230),  // COLOR_F
+        Scalar(240, 240, 0),  // COLOR_G
+        Scalar(117, 44, 0),   // COLOR_A
+        Scalar(0, 230, 240),  // COLOR_H
+        Scalar(0, 210, 0)     // COLOR_TEXT
+    };
 
     return colors[c];
 }
 
+// Label rasterized once with putText, drawn on the frames by copying its pixels.
+struct LabelSprite {
+    // Non-zero on the pixels of the text.
+    Mat mask;
+    // Position of the text origin (bottom-left corner of the text) inside the mask.
+    Point origin;
+    Scalar color;
+};
+
+// Rasterize a label, the same pixels putText would draw.
+// @param text Text of the label.
+// @param fontScale Scale of the FONT_HERSHEY_SIMPLEX font.
+// @param thickness Thickness of the font strokes.
+// @param color Color of the label.
+// @return Sprite of the label.
+LabelSprite createLabelSprite(const string &text, double fontScale, int thickness, const Scalar &color) {
+    int baseline = 0;
+    Size textSize = getTextSize(text, FONT_HERSHEY_SIMPLEX, fontScale, thickness, &baseline);
+
+    // Strokes extend by the thickness around the text box.
+    LabelSprite sprite;
+    sprite.origin = Point(thickness, thickness + textSize.height);
+    sprite.mask = Mat::zeros(textSize.height + baseline + 2 * thickness, textSize.width + 2 * thickness, CV_8UC1);
+    sprite.color = color;
+    putText(sprite.mask, text, sprite.origin, FONT_HERSHEY_SIMPLEX, fontScale, Scalar::all(255), thickness);
+
+    return sprite;
+}
+
+// Draw a label, equivalent to putText with the text origin at origin.
+// @param &img Reference to the image to draw to.
+// @param &sprite Reference to the label.
+// @param origin Position of the text origin in the image.
+void drawLabel(Mat &img, const LabelSprite &sprite, Point origin) {
+    Rect target(origin - sprite.origin, sprite.mask.size());
+    Rect clipped = target & Rect(0, 0, img.cols, img.rows);
+    if(clipped.area() == 0) return;
+
+    img(clipped).setTo(sprite.color, sprite.mask(clipped - target.tl()));
+}
+
+// Highest octave with a note name sprite.
+#define MAX_OCTAVE_NUMBER 31
+
+// Return note name sprite, created the first time it is used.
+// @param note Note of the octave, C to H.
+// @param octaveNumber Number of the octave.
+// @return Sprite of the note name, NULL if the octave has no sprite.
+const LabelSprite *getNoteNameSprite(OctaveNote note, int octaveNumber) {
+    static LabelSprite sprites[H + 1][MAX_OCTAVE_NUMBER + 1];
+    static const char notes[] = "CDEFGAH";
+
+    if(note > H || octaveNumber < 0 || octaveNumber > MAX_OCTAVE_NUMBER) return NULL;
+
+    LabelSprite &sprite = sprites[note][octaveNumber];
+    if(sprite.mask.empty()) {
+        sprite = createLabelSprite(notes[note] + intToString(octaveNumber), 2.0, 3, getColor(COLOR_TEXT));
+    }
+    return &sprite;
+}
+
+// Return chord name sprite, all of them created on the first call.
+// @param chord Root note of the chord, C to H.
+// @return Sprite of the chord name.
+const LabelSprite &getChordNameSprite(OctaveNote chord) {
+    struct ChordNameSprites {
+        LabelSprite sprites[H + 1];
+
+        ChordNameSprites() {
+            static const char chords[] = "CDEFGAH";
+            for(int i = C; i <= H; ++i) {
+                sprites[i] = createLabelSprite(string(1, chords[i]), 1.4, 5, getColor(static_cast<Color>(i)));
+            }
+        }
+    };
+    static const ChordNameSprites chordNames;
+
+    return chordNames.sprites[chord];
+}
+
 // Return octave number for given marker and count of keys.
 // The formula is generated by polynomial interpolation from pairs of values [marker ID, octave number].
 // @param id ID of the marker which has the least ID of detected markers.
@@ -105,179 +214,58 @@ int getOctaveNumber(int id, int keysCount) {
 // @param &img Reference to overlay image.
 // @param octave Number of octave.
 void drawNoteNames(Mat &overlay, int octaveNumber) {
-    int fontFace = FONT_HERSHEY_SIMPLEX;
-    float fontScale = 2.0;
-    int thickness = 3;
-
     float horizontalEighth = overlay.cols / 8;
     float verticalEighth = overlay.rows / 8;
 
     Point2f notePosition = Point2f((horizontalEighth / 8), (overlay.rows - verticalEighth));
-    string notes("CDEFGAHC");
 
-    for(auto c : notes) {
-        putText(overlay, c + intToString(octaveNumber), notePosition, fontFace, fontScale, getColor(COLOR_TEXT), thickness);
-        notePosition.x += horizontalEighth;
+    for(int note = C; note <= CC; ++note) {
         // Second C is one octave higher.
-        if(c == 'H') ++octaveNumber;
+        const LabelSprite *sprite = note == CC ? getNoteNameSprite(C, octaveNumber + 1)
+                                               : getNoteNameSprite(static_cast<OctaveNote>(note), octaveNumber);
+        if(sprite) drawLabel(overlay, *sprite, notePosition);
+        notePosition.x += horizontalEighth;
     }
 }
 
-// Return X coordinate of a given note key.
-// @param horizontalEighth Eighth of a count of columns in the image.
-// @return X coordinate of a given note key.
-float getXCoordOfNote(OctaveNote note, float horizontalEighth) {
-    switch(note) {
-        case C:
-            return 0.0;
-        case D:
-            return horizontalEighth;
-        case E:
-            return horizontalEighth * 2;
-        case F:
-            return horizontalEighth * 3;
-        case G:
-            return horizontalEighth * 4;
-        case A:
-            return horizontalEighth * 5;
-        case H:
-            return horizontalEighth * 6;
-        case CC:
-            return horizontalEighth * 7;
-        default: break;
-    }
+// Geometry of the overlay in normalized octave coordinates, [0, 1] from the left to the right
+// and from the top to the bottom of the overlay image. The octave has 8 keys of equal width.
+static constexpr float KEY_WIDTH = 1.0f / 8;
+
+// Return X coordinate of the left side of a given note key.
+constexpr float getXCoordOfNote(OctaveNote note) {
+    return note * KEY_WIDTH;
 }
 
+// Keys of a chord, the first one is the root note, and the height of its lines.
+struct ChordGeometry {
+    OctaveNote notes[3];
+    float y;
+};
+
+// Chords in order of OctaveNote, each one a bit lower so that lines on the same key don't overlap.
+static constexpr ChordGeometry CHORDS[] = {
+    { { C, E, G }, 5.5f / 8 },
+    { { D, F, A }, 5.6f / 8 },
+    { { E, G, H }, 5.7f / 8 },
+    { { F, A, CC }, 5.8f / 8 },
+    { { G, H, D }, 5.9f / 8 },
+    { { A, E, CC }, 6.0f / 8 },
+    { { H, F, D }, 6.1f / 8 }
+};
+
 // Return structure with starting and ending points of lines for a chord.
 // @param chord Enum representing chord.
-// @param horizontalEighth Eighth of a count of columns in the image.
-// @param verticalEighth Eighth of a count of rows in the image.
+// @param size Size of the overlay image, normalized coordinates are scaled to it.
 // @return Structure with line points for a given chord.
-ChordLinesPoints getChordLinePoints(OctaveNote chord, double horizontalEighth, double verticalEighth) {
+ChordLinesPoints getChordLinePoints(OctaveNote chord, Size size) {
     ChordLinesPoints linesPoints;
-    Point2f point;
-
-    switch(chord) {
-        case C:
-            point.y = verticalEighth * 5.5;
-            point.x = getXCoordOfNote(C, horizontalEighth);
-            linesPoints.lineStarts[0] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[0] = point;
-
-            point.x = getXCoordOfNote(E, horizontalEighth);
-            linesPoints.lineStarts[1] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[1] = point;
-
-            point.x = getXCoordOfNote(G, horizontalEighth);
-            linesPoints.lineStarts[2] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[2] = point;
-            break;
-        case D:
-            point.y = verticalEighth * 5.6;
-            point.x = getXCoordOfNote(D, horizontalEighth);
-            linesPoints.lineStarts[0] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[0] = point;
-
-            point.x = getXCoordOfNote(F, horizontalEighth);
-            linesPoints.lineStarts[1] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[1] = point;
-
-            point.x = getXCoordOfNote(A, horizontalEighth);
-            linesPoints.lineStarts[2] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[2] = point;
-            break;
-        case E:
-            point.y = verticalEighth * 5.7;
-            point.x = getXCoordOfNote(E, horizontalEighth);
-            linesPoints.lineStarts[0] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[0] = point;
-
-            point.x = getXCoordOfNote(G, horizontalEighth);
-            linesPoints.lineStarts[1] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[1] = point;
-
-            point.x = getXCoordOfNote(H, horizontalEighth);
-            linesPoints.lineStarts[2] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[2] = point;
-            break;
-        case F:
-            point.y = verticalEighth * 5.8;
-            point.x = getXCoordOfNote(F, horizontalEighth);
-            linesPoints.lineStarts[0] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[0] = point;
-
-            point.x = getXCoordOfNote(A, horizontalEighth);
-            linesPoints.lineStarts[1] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[1] = point;
-
-            point.x = getXCoordOfNote(CC, horizontalEighth);
-            linesPoints.lineStarts[2] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[2] = point;
-            break;
-        case G:
-            point.y = verticalEighth * 5.9;
-            point.x = getXCoordOfNote(G, horizontalEighth);
-            linesPoints.lineStarts[0] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[0] = point;
-
-            point.x = getXCoordOfNote(H, horizontalEighth);
-            linesPoints.lineStarts[1] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[1] = point;
-
-            point.x = getXCoordOfNote(D, horizontalEighth);
-            linesPoints.lineStarts[2] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[2] = point;
-            break;
-        case A:
-            point.y = verticalEighth * 6.0;
-            point.x = getXCoordOfNote(A, horizontalEighth);
-            linesPoints.lineStarts[0] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[0] = point;
-
-            point.x = getXCoordOfNote(E, horizontalEighth);
-            linesPoints.lineStarts[1] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[1] = point;
-
-            point.x = getXCoordOfNote(CC, horizontalEighth);
-            linesPoints.lineStarts[2] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[2] = point;
-            break;
-        case H:
-            point.y = verticalEighth * 6.1;
-            point.x = getXCoordOfNote(H, horizontalEighth);
-            linesPoints.lineStarts[0] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[0] = point;
-
-            point.x = getXCoordOfNote(F, horizontalEighth);
-            linesPoints.lineStarts[1] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[1] = point;
-
-            point.x = getXCoordOfNote(D, horizontalEighth);
-            linesPoints.lineStarts[2] = point;
-            point.x += horizontalEighth;
-            linesPoints.lineEnds[2] = point;
-            break;
-        default: break;
+    const ChordGeometry &geometry = CHORDS[chord];
+
+    for(int j = 0; j < 3; ++j) {
+        float x = getXCoordOfNote(geometry.notes[j]);
+        linesPoints.lineStarts[j] = Point2f(x * size.width, geometry.y * size.height);
+        linesPoints.lineEnds[j] = Point2f((x + KEY_WIDTH) * size.width, geometry.y * size.height);
     }
 
     return linesPoints;
@@ -287,14 +275,9 @@ ChordLinesPoints getChordLinePoints(OctaveNote chord, double horizontalEighth, d
 // @param &octaveRoi Reference to overlay part which will be drawn to octave region.
 // @param &wholeScreen Reference to image from camera.
 void drawChords(Mat &overlay, Mat &wholeScreen) {
-    int fontFace = FONT_HERSHEY_SIMPLEX;
-    float fontScale = 1.4;
-    int textThickness = 5;
-
     float horizontalEighth = overlay.cols / 8;
     float verticalEighth = overlay.rows / 8;
 
-    string chordNames("CDEFGAH");
     // Chord names will be on top of the whole screen.
     Point2f namePosition = Point2f(horizontalEighth, verticalEighth);
 
@@ -303,11 +286,11 @@ void drawChords(Mat &overlay, Mat &wholeScreen) {
     ChordLinesPoints linesPoints;
 
     // Iterate over chord names, draw a name on top of the screen and lines to keys.
-    for(unsigned int i = 0; i < chordNames.size(); ++i) {
-        putText(wholeScreen, chordNames.substr(i, 1), namePosition, fontFace, fontScale, getColor(static_cast<Color>(i)), textThickness);
+    for(int i = C; i <= H; ++i) {
+        drawLabel(wholeScreen, getChordNameSprite(static_cast<OctaveNote>(i)), namePosition);
         namePosition.x += horizontalEighth;
 
-        linesPoints = getChordLinePoints(static_cast<OctaveNote>(i), horizontalEighth, verticalEighth);
+        linesPoints = getChordLinePoints(static_cast<OctaveNote>(i), overlay.size());
         for(unsigned int j = 0; j < 3; ++j) {
             line(overlay, linesPoints.lineStarts[j], linesPoints.lineEnds[j], getColor(static_cast<Color>(i)), lineThickness);
             // Emphasize root note with white circle in the center of the line.
@@ -323,10 +306,10 @@ void drawChords(Mat &overlay, Mat &wholeScreen) {
 // Draw all virtual content to image.
 // @param &mRgb Reference to color image from camera.
 // @param &markerCorners Reference to vector of vectors of marker corners.
-// @param sortedIds Vector of marker ID's sorted by ID.
-void draw(Mat &mRgb, vector< vector<Point2f> > &markerCorners, vector<int> sortedIds) {
+// @param &layout Reference to the detected keyboard layout.
+void draw(Mat &mRgb, vector< vector<Point2f> > &markerCorners, const KeyboardLayout &layout) {
     // Overlay matrix, where all virtual content is drawn.
-    Mat overlay(mRgb.rows, mRgb.cols, CV_8UC4);
+    Mat overlay(mRgb.rows, mRgb.cols, CV_8UC4, Scalar::all(0));
 
     // Helper matrices.
     Mat overlayWarped, mask, maskInv, result1, result2;
@@ -341,7 +324,7 @@ void draw(Mat &mRgb, vector< vector<Point2f> > &markerCorners, vector<int> sorte
     vector< Point2f > overlayCorners;
 
     // Number of the octave.
-    int octaveNumber = getOctaveNumber(sortedIds.back(), KEYS_COUNT);
+    int octaveNumber = getOctaveNumber(layout.minId, layout.keysCount);
 
     // Fill overlay corners.
     overlayCorners.push_back(Point2f(0.0, 0.0));
@@ -349,19 +332,22 @@ void draw(Mat &mRgb, vector< vector<Point2f> > &markerCorners, vector<int> sorte
     overlayCorners.push_back(Point2f(overlay.cols, 0.0));
     overlayCorners.push_back(Point2f(overlay.cols, overlay.rows));
 
+    // Chords are the same on all octaves, drawn only once.
+    drawChords(overlay, mRgb);
+
     // Repeat for each octave, octaves share 2 markers on start/end.
-    for(unsigned int i = 0; i < (sortedIds.size() - 3); i += 2)
+    for(int i = 0; i + 3 < layout.detectedCount; i += 2)
     {
+        const array<int, MAX_MARKERS_COUNT> &indexes = layout.markerIndexes;
+
         drawNoteNames(overlay, octaveNumber);
         ++octaveNumber;
 
-        drawChords(overlay, mRgb);
-
         // Fill octave corners.
-        octaveCorners.push_back(markerCorners[sortedIds[i]][BOTTOM_LEFT]);
-        octaveCorners.push_back(markerCorners[sortedIds[i+1]][BOTTOM_LEFT]);
-        octaveCorners.push_back(markerCorners[sortedIds[i+2]][BOTTOM_RIGHT]);
-        octaveCorners.push_back(markerCorners[sortedIds[i+3]][BOTTOM_RIGHT]);
+        octaveCorners.push_back(markerCorners[indexes[i]][BOTTOM_LEFT]);
+        octaveCorners.push_back(markerCorners[indexes[i+1]][BOTTOM_LEFT]);
+        octaveCorners.push_back(markerCorners[indexes[i+2]][BOTTOM_RIGHT]);
+        octaveCorners.push_back(markerCorners[indexes[i+3]][BOTTOM_RIGHT]);
 
         // Compute homography between overlay and octave corners.
         H = findHomography(overlayCorners, octaveCorners, RHO);
@@ -395,6 +381,338 @@ void draw(Mat &mRgb, vector< vector<Point2f> > &markerCorners, vector<int> sorte
     }
 }
 
+// Lens distortion of the headset, radial polynomial r' = r * (1 + k1 * r^2 + k2 * r^4) with the
+// radius r in tan-angle units, the distance from the lens center on the screen divided by the
+// distance from the screen to the lens, as the coefficients of the Cardboard viewer profiles.
+struct LensProfile {
+    float k1;
+    float k2;
+    // Distance from the screen to the lenses, in millimeters.
+    float screenToLens;
+    // Pixels of the stereo image per millimeter of the screen.
+    float pixelsPerMm;
+};
+
+// Remap tables of the stereo composition with barrel distortion, for one frame size, eye offset
+// and lens profile.
+struct StereoRemap {
+    Size size;
+    int eyeOffset;
+    LensProfile lens;
+    // Fixed-point maps from convertMaps, source position of each output pixel.
+    Mat map1, map2;
+};
+
+// Compute the remap tables of the stereo composition. Each eye samples the whole frame, so the
+// half width downsample and the barrel distortion that compensates the lens are a single lookup.
+// @param size Size of the frame and of the output image.
+// @param eyeOffset Horizontal shift of each lens center towards the center of the screen, in pixels.
+// @param lens Distortion of the headset lenses.
+// @param &remap Reference to the tables to fill.
+void computeStereoRemap(Size size, int eyeOffset, const LensProfile &lens, StereoRemap &remap) {
+    int half = size.width / 2;
+    float eyeCenterX = half / 2.0f;
+    float eyeCenterY = size.height / 2.0f;
+    // Frame pixels per eye pixel, horizontally.
+    float scaleX = (float) size.width / half;
+    // Pixels of the stereo image per tan-angle unit.
+    float tanAngleScale = lens.screenToLens * lens.pixelsPerMm;
+    CV_Assert(tanAngleScale > 0);
+
+    Mat mapX(size, CV_32FC1, Scalar::all(-1)), mapY(size, CV_32FC1, Scalar::all(-1));
+    for(int y = 0; y < size.height; y++) {
+        float *rowX = mapX.ptr<float>(y);
+        float *rowY = mapY.ptr<float>(y);
+
+        for(int eye = 0; eye < 2; eye++) {
+            // Lens centers are shifted towards the center of the screen.
+            float lensCenterX = eyeCenterX + (eye == 0 ? eyeOffset : -eyeOffset);
+
+            for(int x = 0; x < half; x++) {
+                float dx = (x - lensCenterX) / tanAngleScale;
+                float dy = (y - eyeCenterY) / tanAngleScale;
+                float r2 = dx * dx + dy * dy;
+                float distortion = 1 + lens.k1 * r2 + lens.k2 * r2 * r2;
+
+                // Position in the eye image, then in the frame.
+                float eyeX = eyeCenterX + dx * distortion * tanAngleScale;
+                float eyeY = eyeCenterY + dy * distortion * tanAngleScale;
+                rowX[eye * half + x] = (eyeX + 0.5f) * scaleX - 0.5f;
+                rowY[eye * half + x] = eyeY;
+            }
+        }
+    }
+
+    convertMaps(mapX, mapY, remap.map1, remap.map2, CV_16SC2);
+    remap.size = size;
+    remap.eyeOffset = eyeOffset;
+    remap.lens = lens;
+}
+
+// Compose the side by side stereo image for the headset. Each eye gets the frame downsampled to
+// half width, averaging pairs of pixels, written directly to its half of the output.
+// @param &src Reference to color image from camera with the virtual content.
+// @param &dst Reference to output image, allocated with the size and type of src if they differ.
+// @param eyeOffset Horizontal shift of each eye image towards the center of the screen, in pixels.
+// @param lens Distortion of the headset lenses. Without distortion the frame is only downsampled,
+// otherwise it is remapped with tables computed once.
+void composeStereo(const Mat &src, Mat &dst, int eyeOffset, const LensProfile &lens) {
+    if(lens.k1 != 0 || lens.k2 != 0) {
+        CV_Assert(src.data != dst.data);
+
+        // Tables are recomputed only when the frame size, offset or lens change.
+        static StereoRemap stereoRemap;
+        if(stereoRemap.map1.empty() || stereoRemap.size != src.size() ||
+           stereoRemap.eyeOffset != eyeOffset || stereoRemap.lens.k1 != lens.k1 ||
+           stereoRemap.lens.k2 != lens.k2 || stereoRemap.lens.screenToLens != lens.screenToLens ||
+           stereoRemap.lens.pixelsPerMm != lens.pixelsPerMm) {
+            computeStereoRemap(src.size(), eyeOffset, lens, stereoRemap);
+        }
+
+        remap(src, dst, stereoRemap.map1, stereoRemap.map2, INTER_LINEAR, BORDER_CONSTANT, Scalar::all(0));
+        return;
+    }
+
+    CV_Assert(src.type() == CV_8UC4 && src.data != dst.data);
+    dst.create(src.size(), src.type());
+
+    int half = src.cols / 2;
+
+    for(int y = 0; y < src.rows; y++) {
+        const uchar *in = src.ptr<uchar>(y);
+        uchar *left = dst.ptr<uchar>(y);
+        uchar *right = left + 4 * half;
+
+        for(int x = 0; x < half; x++) {
+            // Source pixel pairs of each eye, black where the shifted image doesn't reach.
+            int leftSource = x - eyeOffset;
+            int rightSource = x + eyeOffset;
+
+            for(int c = 0; c < 4; c++) {
+                left[4 * x + c] = leftSource >= 0 && leftSource < half
+                        ? (in[8 * leftSource + c] + in[8 * leftSource + 4 + c] + 1) >> 1 : 0;
+                right[4 * x + c] = rightSource >= 0 && rightSource < half
+                        ? (in[8 * rightSource + c] + in[8 * rightSource + 4 + c] + 1) >> 1 : 0;
+            }
+        }
+
+        // Last column of odd widths is not covered by any eye.
+        if(src.cols % 2) memset(left + 4 * (src.cols - 1), 0, 4);
+    }
+}
+
+// Detect the markers of the keyboard.
+// Only one thread may call it at a time, the identification cache is kept between calls.
+// @param &mGr Reference to grayscale image from camera.
+// @param keyboardMarkers Number of markers of the keyboard, other ids are not identified.
+// @param &markerCorners Reference to vector of vectors of 4 points representing marker corners.
+// @param &markerIds Reference to vector of marker ID's, in the same order than markerCorners.
+void detectKeyboardMarkers(const Mat &mGr, int keyboardMarkers, vector< vector<Point2f> > &markerCorners,
+                           vector< int > &markerIds) {
+    // ArUco dictionary containing 50 ID's of markers size 4x4.
+    Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_4X4_50);
+
+    // Markers identified in previous frames, kept between calls because the keyboard
+    // barely moves from one frame to the next.
+    static Ptr<IdentificationCache> identificationCache = IdentificationCache::create();
+
+    static Ptr<DetectorParameters> detectorParameters =
+            createKeyboardDetectorParameters(keyboardMarkers);
+    if((int)detectorParameters->allowedIds.size() != keyboardMarkers) {
+        detectorParameters = createKeyboardDetectorParameters(keyboardMarkers);
+    }
+
+    try {
+        detectMarkers(mGr, dictionary, markerCorners, markerIds, detectorParameters,
+                      noArray(), identificationCache);
+    } catch (cv::Exception& e) {
+        markerCorners.clear();
+        markerIds.clear();
+        __android_log_print(ANDROID_LOG_VERBOSE, APPNAME, "%s", e.what());
+    }
+}
+
+// Draw the virtual keyboard for the detected markers.
+// @param &mRgb Reference to color image from camera.
+// @param &markerCorners Reference to vector of vectors of marker corners.
+// @param &markerIds Reference to vector of marker ID's.
+// @param keyboardMarkers Number of markers of the keyboard.
+void drawKeyboard(Mat &mRgb, vector< vector<Point2f> > &markerCorners, const vector< int > &markerIds,
+                  int keyboardMarkers) {
+    KeyboardLayout layout;
+    layout.keysCount = keysCount;
+    getKeyboardLayout(markerIds, keyboardMarkers, layout);
+
+    // Draw only if at least 4 markers were detected, that means octave can be drawn.
+    if(layout.detectedCount > 3) {
+        try {
+            draw(mRgb, markerCorners, layout);
+        } catch (cv::Exception& e) {
+            __android_log_print(ANDROID_LOG_VERBOSE, APPNAME, "%s", e.what());
+        }
+    }
+}
+
+// Frame waiting for the detection.
+struct CapturedFrame {
+    Mat gray;
+    // Tick count when the frame was received from the camera.
+    int64 captureTime;
+};
+
+// Markers detected in a frame.
+struct DetectionResult {
+    vector< vector<Point2f> > markerCorners;
+    vector< int > markerIds;
+    int keyboardMarkers;
+    int64 captureTime;
+    // Tick count when the detection of the frame finished.
+    int64 detectionTime;
+};
+
+// Detection running on its own thread, so that the camera thread only copies the frame and draws
+// the latest detected markers. The camera thread always replaces the pending frame, so the
+// detection works on the newest one. Frames and results are passed without locks, the mutex is
+// only used to wake up the detection thread.
+class MarkerPipeline {
+public:
+    MarkerPipeline() : running(false), renderedFrames(0), latencySum(0), detectionSum(0) {
+        latest.keyboardMarkers = 0;
+        latest.captureTime = 0;
+        latest.detectionTime = 0;
+    }
+
+    ~MarkerPipeline() {
+        stop();
+    }
+
+    void start() {
+        if(running) return;
+        running = true;
+        detectionThread = thread(&MarkerPipeline::detectionLoop, this);
+    }
+
+    void stop() {
+        if(!running) return;
+        {
+            lock_guard<mutex> lock(wakeMutex);
+            running = false;
+        }
+        wakeCondition.notify_one();
+        detectionThread.join();
+    }
+
+    bool isRunning() const {
+        return running;
+    }
+
+    // Called from the camera thread. Queue the frame for detection and draw the latest markers.
+    // @param &mGr Reference to grayscale image from camera.
+    // @param &mRgb Reference to color image from camera.
+    void processFrame(const Mat &mGr, Mat &mRgb) {
+        int64 now = getTickCount();
+
+        // A frame still pending while the detection is behind is replaced by this one.
+        CapturedFrame *frame = frames.backSlot();
+        mGr.copyTo(frame->gray);
+        frame->captureTime = now;
+        {
+            // Published under the lock, so that the detection thread cannot miss it between its
+            // check and its wait.
+            lock_guard<mutex> lock(wakeMutex);
+            frames.publish();
+            wakeCondition.notify_one();
+        }
+
+        // Keep only the most recent result, its buffers are swapped to reuse the old ones.
+        while(DetectionResult *result = results.front()) {
+            swap(latest.markerCorners, result->markerCorners);
+            swap(latest.markerIds, result->markerIds);
+            latest.keyboardMarkers = result->keyboardMarkers;
+            latest.captureTime = result->captureTime;
+            latest.detectionTime = result->detectionTime;
+            results.pop();
+        }
+
+        if(latest.captureTime == 0) return;
+        drawKeyboard(mRgb, latest.markerCorners, latest.markerIds, latest.keyboardMarkers);
+        logLatency(now);
+    }
+
+private:
+    void detectionLoop() {
+        while(running) {
+            CapturedFrame *frame = frames.take();
+            if(!frame) {
+                unique_lock<mutex> lock(wakeMutex);
+                wakeCondition.wait(lock, [this] { return !running || frames.hasNew(); });
+                continue;
+            }
+
+            // Results are dropped if the render stage stopped reading them.
+            DetectionResult *result = results.beginPush();
+            if(result) {
+                result->keyboardMarkers = markersCount;
+                detectKeyboardMarkers(frame->gray, result->keyboardMarkers, result->markerCorners,
+                                      result->markerIds);
+                result->captureTime = frame->captureTime;
+                result->detectionTime = getTickCount();
+                results.endPush();
+            }
+        }
+    }
+
+    // Accumulate the age of the markers drawn in each frame, and log the averages every
+    // LATENCY_LOG_FRAMES frames.
+    void logLatency(int64 renderTime) {
+        static const int LATENCY_LOG_FRAMES = 100;
+
+        double ticksPerMs = getTickFrequency() / 1000.0;
+        latencySum += (renderTime - latest.captureTime) / ticksPerMs;
+        detectionSum += (latest.detectionTime - latest.captureTime) / ticksPerMs;
+        if(++renderedFrames < LATENCY_LOG_FRAMES) return;
+
+        __android_log_print(ANDROID_LOG_DEBUG, APPNAME, "Markers age %.1f ms, detection %.1f ms",
+                            latencySum / renderedFrames, detectionSum / renderedFrames);
+        renderedFrames = 0;
+        latencySum = 0;
+        detectionSum = 0;
+    }
+
+    FrameMailbox<CapturedFrame> frames;
+    FrameQueue<DetectionResult, 4> results;
+    // Most recent result, only used by the camera thread.
+    DetectionResult latest;
+
+    atomic<bool> running;
+    thread detectionThread;
+    mutex wakeMutex;
+    condition_variable wakeCondition;
+
+    int renderedFrames;
+    double latencySum;
+    double detectionSum;
+};
+
+static MarkerPipeline pipeline;
+
+// Set the size of the keyboard.
+// @param keysCount Count of keys on the piano.
+// @param keyboardMarkers Number of markers on the keyboard, with ids from 0.
+JNIEXPORT void JNICALL
+Java_cz_email_michalchomo_cardboardkeyboard_MainActivity_setKeyboardLayout(JNIEnv *env,
+                                                                         jobject thiz,
+                                                                         jint keys,
+                                                                         jint keyboardMarkers) {
+    if(keys <= 0 || keyboardMarkers < 4 || keyboardMarkers > MAX_MARKERS_COUNT) {
+        __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Unsupported keyboard of %d keys and %d markers",
+                            keys, keyboardMarkers);
+        return;
+    }
+    keysCount = keys;
+    markersCount = keyboardMarkers;
+}
+
 JNIEXPORT void JNICALL
 Java_cz_email_michalchomo_cardboardkeyboard_MainActivity_detectMarkersAndDraw(JNIEnv *env,
                                                                             jlong matAddrGr,
@@ -410,24 +728,60 @@ Java_cz_email_michalchomo_cardboardkeyboard_MainActivity_detectMarkersAndDraw(JN
     // First corner is top left and continuing clockwise.
     vector< vector<Point2f> > markerCorners;
 
-    // ArUco dictionary containing 50 ID's of markers size 4x4.
-    Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_4X4_50);
+    int keyboardMarkers = markersCount;
+    detectKeyboardMarkers(mGr, keyboardMarkers, markerCorners, markerIds);
+    drawKeyboard(mRgb, markerCorners, markerIds, keyboardMarkers);
+}
+
+JNIEXPORT void JNICALL
+Java_cz_email_michalchomo_cardboardkeyboard_MainActivity_composeStereo(JNIEnv *env,
+                                                                     jobject thiz,
+                                                                     jlong matAddrRgba,
+                                                                     jlong matAddrStereo,
+                                                                     jint eyeOffset,
+                                                                     jfloat k1,
+                                                                     jfloat k2,
+                                                                     jfloat screenToLens,
+                                                                     jfloat pixelsPerMm) {
+    Mat &mRgb = *(Mat *) matAddrRgba;
+    Mat &mStereo = *(Mat *) matAddrStereo;
+
+    LensProfile lens;
+    lens.k1 = k1;
+    lens.k2 = k2;
+    lens.screenToLens = screenToLens;
+    lens.pixelsPerMm = pixelsPerMm;
 
     try {
-        detectMarkers(mGr, dictionary, markerCorners, markerIds);
+        composeStereo(mRgb, mStereo, eyeOffset, lens);
     } catch (cv::Exception& e) {
         __android_log_print(ANDROID_LOG_VERBOSE, APPNAME, "%s", e.what());
     }
+}
 
-    // Draw only if at least 4 markers were detected, that means octave can be drawn.
-    if(markerIds.size() > 3) {
-        try {
-            draw(mRgb, markerCorners, getSortedIds(markerIds));
-        } catch (cv::Exception& e) {
-            __android_log_print(ANDROID_LOG_VERBOSE, APPNAME, "%s", e.what());
-        }
-    }
 
+JNIEXPORT void JNICALL
+Java_cz_email_michalchomo_cardboardkeyboard_MainActivity_startPipeline(JNIEnv *env,
+                                                                     jobject thiz) {
+    pipeline.start();
 }
 
-}
\ No newline at end of file
+JNIEXPORT void JNICALL
+Java_cz_email_michalchomo_cardboardkeyboard_MainActivity_stopPipeline(JNIEnv *env,
+                                                                    jobject thiz) {
+    pipeline.stop();
+}
+
+JNIEXPORT void JNICALL
+Java_cz_email_michalchomo_cardboardkeyboard_MainActivity_processFrame(JNIEnv *env,
+                                                                    jobject thiz,
+                                                                    jlong matAddrGr,
+                                                                    jlong matAddrRgba) {
+    // Grayscale and color image from camera.
+    Mat &mGr = *(Mat *) matAddrGr;
+    Mat &mRgb = *(Mat *) matAddrRgba;
+
+    pipeline.processFrame(mGr, mRgb);
+}
+
+}
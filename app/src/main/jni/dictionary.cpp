@@ -38,10 +38,22 @@ the use of this software, even if advised of the possibility of such damage.
 
 #include "precomp.hpp"
 #include "dictionary.hpp"
+#include "marker_kernels.hpp"
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
+#ifndef ARUCO_NO_PREDEFINED_DICTIONARIES
 #include "predefined_dictionaries.hpp"
+#endif
 #include <opencv2/core/hal/hal.hpp>
+#include <cstdio>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ARUCO_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace cv {
 namespace aruco {
@@ -49,12 +61,42 @@ namespace aruco {
 using namespace std;
 
 
+/**
+  * @brief Bit permutation for the 4 rotations of a markerSize x markerSize code
+  *
+  * cells[r*nbits + k] is the row-major index of the bit that goes to the k-th position of the
+  * r-th rotation, the same rotations stored in bytesList.
+  */
+struct RotationTable {
+    int nbits;
+    vector< int > cells;
+
+    RotationTable() : nbits(0) {}
+
+    void build(int markerSize) {
+        nbits = markerSize * markerSize;
+        cells.resize(4 * nbits);
+
+        int n = markerSize;
+        for(int row = 0, k = 0; row < n; row++) {
+            for(int col = 0; col < n; col++, k++) {
+                cells[0 * nbits + k] = row * n + col;
+                cells[1 * nbits + k] = col * n + (n - 1 - row);
+                cells[2 * nbits + k] = (n - 1 - row) * n + (n - 1 - col);
+                cells[3 * nbits + k] = (n - 1 - col) * n + row;
+            }
+        }
+    }
+};
+
+
 /**
   */
 Dictionary::Dictionary(const Ptr<Dictionary> &_dictionary) {
     markerSize = _dictionary->markerSize;
     maxCorrectionBits = _dictionary->maxCorrectionBits;
     bytesList = _dictionary->bytesList.clone();
+    allowedIds = _dictionary->allowedIds;
 }
 
 
@@ -90,6 +132,56 @@ Ptr<Dictionary> Dictionary::get(int dict) {
 }
 
 
+/**
+ */
+Ptr<Dictionary> Dictionary::createView(const Ptr<Dictionary> &baseDictionary,
+                                       const vector< int > &ids) {
+
+    CV_Assert(!baseDictionary.empty());
+
+    // the view of a view only contains the ids allowed in both of them
+    vector< int > viewIds;
+    viewIds.reserve(ids.size());
+    for(size_t i = 0; i < ids.size(); i++)
+        if(baseDictionary->isAllowedId(ids[i])) viewIds.push_back(ids[i]);
+    sort(viewIds.begin(), viewIds.end());
+    viewIds.erase(unique(viewIds.begin(), viewIds.end()), viewIds.end());
+
+    // markers after the last allowed id are not needed
+    int nMarkers = viewIds.empty() ? 0 : viewIds.back() + 1;
+    Ptr<Dictionary> view = makePtr<Dictionary>(baseDictionary->bytesList.rowRange(0, nMarkers),
+                                               baseDictionary->markerSize,
+                                               baseDictionary->maxCorrectionBits);
+    view->storage = baseDictionary->storage;
+
+    // a view of the first markers is only a shorter bytesList
+    if((int)viewIds.size() != nMarkers) view->allowedIds = viewIds;
+    return view;
+}
+
+
+/**
+ */
+Ptr<Dictionary> Dictionary::createView(const Ptr<Dictionary> &baseDictionary, int firstId,
+                                       int lastId) {
+
+    CV_Assert(!baseDictionary.empty());
+
+    vector< int > ids;
+    for(int id = max(firstId, 0); id < min(lastId, baseDictionary->bytesList.rows); id++)
+        ids.push_back(id);
+    return createView(baseDictionary, ids);
+}
+
+
+/**
+ */
+bool Dictionary::isAllowedId(int id) const {
+    if(id < 0 || id >= bytesList.rows) return false;
+    return allowedIds.empty() || binary_search(allowedIds.begin(), allowedIds.end(), id);
+}
+
+
 /**
  */
 bool Dictionary::identify(const Mat &onlyBits, int &idx, int &rotation,
@@ -99,36 +191,16 @@ bool Dictionary::identify(const Mat &onlyBits, int &idx, int &rotation,
 
     int maxCorrectionRecalculed = int(double(maxCorrectionBits) * maxCorrectionRate);
 
-    // get as a byte list
-    Mat candidateBytes = getByteListFromBits(onlyBits);
-
-    idx = -1; // by default, not found
+    // get as a byte list, only the normal rotation is needed since the dictionary already
+    // contains the four rotations of each marker
+    const MarkerKernels &kernels = getKernels();
+    AutoBuffer< uchar > candidateBytes((size_t)(markerSize * markerSize + 8 - 1) / 8);
+    kernels.packBits(onlyBits, markerSize, candidateBytes);
 
     // search closest marker in dict
-    for(int m = 0; m < bytesList.rows; m++) {
-        int currentMinDistance = markerSize * markerSize + 1;
-        int currentRotation = -1;
-        for(unsigned int r = 0; r < 4; r++) {
-            int currentHamming = cv::hal::normHamming(
-                    bytesList.ptr(m)+r*candidateBytes.cols,
-                    candidateBytes.ptr(),
-                    candidateBytes.cols);
-
-            if(currentHamming < currentMinDistance) {
-                currentMinDistance = currentHamming;
-                currentRotation = r;
-            }
-        }
-
-        // if maxCorrection is fullfilled, return this one
-        if(currentMinDistance <= maxCorrectionRecalculed) {
-            idx = m;
-            rotation = currentRotation;
-            break;
-        }
-    }
-
-    return idx != -1;
+    return kernels.identify(bytesList, allowedIds.empty() ? 0 : &allowedIds[0],
+                            (int)allowedIds.size(), candidateBytes, markerSize,
+                            maxCorrectionRecalculed, idx, rotation);
 }
 
 
@@ -141,16 +213,49 @@ int Dictionary::getDistanceToId(InputArray bits, int id, bool allRotations) cons
     unsigned int nRotations = 4;
     if(!allRotations) nRotations = 1;
 
-    Mat candidateBytes = getByteListFromBits(bits.getMat());
+    Mat bitsMat = bits.getMat();
+    CV_Assert(bitsMat.rows == bitsMat.cols && bitsMat.type() == CV_8UC1);
+    int nbytes = (bitsMat.cols * bitsMat.rows + 8 - 1) / 8;
+    AutoBuffer< uchar > candidateBytes((size_t)nbytes);
+    getMarkerKernels(bitsMat.rows, 1).packBits(bitsMat, bitsMat.rows, candidateBytes);
+
     int currentMinDistance = int(bits.total() * bits.total());
     for(unsigned int r = 0; r < nRotations; r++) {
         int currentHamming = cv::hal::normHamming(
-                bytesList.ptr(id) + r*candidateBytes.cols,
-                candidateBytes.ptr(),
-                candidateBytes.cols);
+                bytesList.ptr(id) + r*nbytes,
+                candidateBytes,
+                nbytes);
+
+        if(currentHamming < currentMinDistance) {
+            currentMinDistance = currentHamming;
+        }
+    }
+    return currentMinDistance;
+}
+
+
+
+/**
+  */
+int Dictionary::getDistanceAndRotationToId(InputArray bits, int id, int &rotation) const {
+
+    CV_Assert(id >= 0 && id < bytesList.rows);
+
+    Mat bitsMat = bits.getMat();
+    CV_Assert(bitsMat.rows == bitsMat.cols && bitsMat.type() == CV_8UC1);
+    int nbytes = (bitsMat.cols * bitsMat.rows + 8 - 1) / 8;
+    AutoBuffer< uchar > candidateBytes((size_t)nbytes);
+    getMarkerKernels(bitsMat.rows, 1).packBits(bitsMat, bitsMat.rows, candidateBytes);
+
+    rotation = 0;
+    int currentMinDistance = int(bits.total() * bits.total());
+    for(int r = 0; r < 4; r++) {
+        int currentHamming = cv::hal::normHamming(bytesList.ptr(id) + r*nbytes, candidateBytes,
+                                                  nbytes);
 
         if(currentHamming < currentMinDistance) {
             currentMinDistance = currentHamming;
+            rotation = r;
         }
     }
     return currentMinDistance;
@@ -158,6 +263,14 @@ int Dictionary::getDistanceToId(InputArray bits, int id, bool allRotations) cons
 
 
 
+/**
+  */
+const MarkerKernels &Dictionary::getKernels(int borderBits) const {
+    return getMarkerKernels(markerSize, borderBits);
+}
+
+
+
 /**
  * @brief Draw a canonical marker image
  */
@@ -193,35 +306,20 @@ Mat Dictionary::getByteListFromBits(const Mat &bits) {
     // integer ceil
     int nbytes = (bits.cols * bits.rows + 8 - 1) / 8;
 
-    Mat candidateByteList(1, nbytes, CV_8UC4, Scalar::all(0));
-    unsigned char currentBit = 0;
-    int currentByte = 0;
-
-    // the 4 rotations
-    uchar* rot0 = candidateByteList.ptr();
-    uchar* rot1 = candidateByteList.ptr() + 1*nbytes;
-    uchar* rot2 = candidateByteList.ptr() + 2*nbytes;
-    uchar* rot3 = candidateByteList.ptr() + 3*nbytes;
-
-    for(int row = 0; row < bits.rows; row++) {
-        for(int col = 0; col < bits.cols; col++) {
-            // circular shift
-            rot0[currentByte] <<= 1;
-            rot1[currentByte] <<= 1;
-            rot2[currentByte] <<= 1;
-            rot3[currentByte] <<= 1;
-            // set bit
-            rot0[currentByte] |= bits.at<uchar>(row, col);
-            rot1[currentByte] |= bits.at<uchar>(col, bits.cols - 1 - row);
-            rot2[currentByte] |= bits.at<uchar>(bits.rows - 1 - row, bits.cols - 1 - col);
-            rot3[currentByte] |= bits.at<uchar>(bits.rows - 1 - col, row);
-            currentBit++;
-            if(currentBit == 8) {
-                // next byte
-                currentBit = 0;
-                currentByte++;
-            }
+    CV_Assert(bits.rows == bits.cols && bits.type() == CV_8UC1);
+
+    // each rotation is packed with the same kernel used to identify the markers, so both are
+    // always consistent. Rotation r + 1 takes its cell (row, col) from the cell
+    // (col, markerSize - 1 - row) of rotation r, i.e. a horizontal flip and a transposition
+    const MarkerKernels &kernels = getMarkerKernels(bits.rows, 1);
+    Mat candidateByteList(1, nbytes, CV_8UC4);
+    Mat rotated = bits.clone(), flipped;
+    for(int r = 0; r < 4; r++) {
+        if(r > 0) {
+            flip(rotated, flipped, 1);
+            transpose(flipped, rotated);
         }
+        kernels.packBits(rotated, bits.rows, candidateByteList.ptr() + r * nbytes);
     }
     return candidateByteList;
 }
@@ -267,90 +365,261 @@ Mat Dictionary::getBitsFromByteList(const Mat &byteList, int markerSize) {
 
 
 
-// DictionaryData constructors calls
-const Dictionary DICT_ARUCO_DATA = Dictionary(Mat(1024, (5*5 + 7)/8, CV_8UC4, (uchar*)DICT_ARUCO_BYTES), 5, 0);
+#ifndef ARUCO_NO_PREDEFINED_DICTIONARIES
+/**
+  * @brief Parameters of a predefined dictionary
+  *
+  * The dictionaries of the same size share the table of the biggest one, with a different number
+  * of markers.
+  */
+struct PredefinedDictionaryData {
+    const void *bytes;
+    int nMarkers;
+    int markerSize;
+    int maxCorrectionBits;
+};
 
-const Dictionary DICT_4X4_50_DATA = Dictionary(Mat(50, (4*4 + 7)/8, CV_8UC4, (uchar*)DICT_4X4_1000_BYTES), 4, 1);
-const Dictionary DICT_4X4_100_DATA = Dictionary(Mat(100, (4*4 + 7)/8, CV_8UC4, (uchar*)DICT_4X4_1000_BYTES), 4, 1);
-const Dictionary DICT_4X4_250_DATA = Dictionary(Mat(250, (4*4 + 7)/8, CV_8UC4, (uchar*)DICT_4X4_1000_BYTES), 4, 1);
-const Dictionary DICT_4X4_1000_DATA = Dictionary(Mat(1000, (4*4 + 7)/8, CV_8UC4, (uchar*)DICT_4X4_1000_BYTES), 4, 0);
 
-const Dictionary DICT_5X5_50_DATA = Dictionary(Mat(50, (5*5 + 7)/8, CV_8UC4, (uchar*)DICT_5X5_1000_BYTES), 5, 3);
-const Dictionary DICT_5X5_100_DATA = Dictionary(Mat(100, (5*5 + 7)/8, CV_8UC4, (uchar*)DICT_5X5_1000_BYTES), 5, 3);
-const Dictionary DICT_5X5_250_DATA = Dictionary(Mat(250, (5*5 + 7)/8, CV_8UC4, (uchar*)DICT_5X5_1000_BYTES), 5, 2);
-const Dictionary DICT_5X5_1000_DATA = Dictionary(Mat(1000, (5*5 + 7)/8, CV_8UC4, (uchar*)DICT_5X5_1000_BYTES), 5, 2);
+/**
+  * @brief Predefined dictionaries, indexed by PREDEFINED_DICTIONARY_NAME
+  */
+static const PredefinedDictionaryData PREDEFINED_DICTIONARIES[DICT_ARUCO_ORIGINAL + 1] = {
+    { DICT_4X4_1000_BYTES, 50, 4, 1 },     // DICT_4X4_50
+    { DICT_4X4_1000_BYTES, 100, 4, 1 },    // DICT_4X4_100
+    { DICT_4X4_1000_BYTES, 250, 4, 1 },    // DICT_4X4_250
+    { DICT_4X4_1000_BYTES, 1000, 4, 0 },   // DICT_4X4_1000
+    { DICT_5X5_1000_BYTES, 50, 5, 3 },     // DICT_5X5_50
+    { DICT_5X5_1000_BYTES, 100, 5, 3 },    // DICT_5X5_100
+    { DICT_5X5_1000_BYTES, 250, 5, 2 },    // DICT_5X5_250
+    { DICT_5X5_1000_BYTES, 1000, 5, 2 },   // DICT_5X5_1000
+    { DICT_6X6_1000_BYTES, 50, 6, 6 },     // DICT_6X6_50
+    { DICT_6X6_1000_BYTES, 100, 6, 5 },    // DICT_6X6_100
+    { DICT_6X6_1000_BYTES, 250, 6, 5 },    // DICT_6X6_250
+    { DICT_6X6_1000_BYTES, 1000, 6, 4 },   // DICT_6X6_1000
+    { DICT_7X7_1000_BYTES, 50, 7, 9 },     // DICT_7X7_50
+    { DICT_7X7_1000_BYTES, 100, 7, 8 },    // DICT_7X7_100
+    { DICT_7X7_1000_BYTES, 250, 7, 8 },    // DICT_7X7_250
+    { DICT_7X7_1000_BYTES, 1000, 7, 6 },   // DICT_7X7_1000
+    { DICT_ARUCO_BYTES, 1024, 5, 0 }       // DICT_ARUCO_ORIGINAL
+};
 
-const Dictionary DICT_6X6_50_DATA = Dictionary(Mat(50, (6*6 + 7)/8 ,CV_8UC4, (uchar*)DICT_6X6_1000_BYTES), 6, 6);
-const Dictionary DICT_6X6_100_DATA = Dictionary(Mat(100, (6*6 + 7)/8 ,CV_8UC4, (uchar*)DICT_6X6_1000_BYTES), 6, 5);
-const Dictionary DICT_6X6_250_DATA = Dictionary(Mat(250, (6*6 + 7)/8 ,CV_8UC4, (uchar*)DICT_6X6_1000_BYTES), 6, 5);
-const Dictionary DICT_6X6_1000_DATA = Dictionary(Mat(1000, (6*6 + 7)/8 ,CV_8UC4, (uchar*)DICT_6X6_1000_BYTES), 6, 4);
 
-const Dictionary DICT_7X7_50_DATA = Dictionary(Mat(50, (7*7 + 7)/8 ,CV_8UC4, (uchar*)DICT_7X7_1000_BYTES), 7, 9);
-const Dictionary DICT_7X7_100_DATA = Dictionary(Mat(100, (7*7 + 7)/8 ,CV_8UC4, (uchar*)DICT_7X7_1000_BYTES), 7, 8);
-const Dictionary DICT_7X7_250_DATA = Dictionary(Mat(250, (7*7 + 7)/8 ,CV_8UC4, (uchar*)DICT_7X7_1000_BYTES), 7, 8);
-const Dictionary DICT_7X7_1000_DATA = Dictionary(Mat(1000, (7*7 + 7)/8 ,CV_8UC4, (uchar*)DICT_7X7_1000_BYTES), 7, 6);
+/**
+  */
+Ptr<Dictionary> getPredefinedDictionary(PREDEFINED_DICTIONARY_NAME name) {
 
+    if(name < DICT_4X4_50 || name > DICT_ARUCO_ORIGINAL) name = DICT_4X4_50;
+    const PredefinedDictionaryData &data = PREDEFINED_DICTIONARIES[name];
 
+    // each call gets its own dictionary, but bytesList is a header over the constant table in
+    // predefined_dictionaries.hpp, no byte is copied
+    Mat bytesList(data.nMarkers, (data.markerSize * data.markerSize + 7) / 8, CV_8UC4,
+                  (void *)data.bytes);
+    return makePtr<Dictionary>(bytesList, data.markerSize, data.maxCorrectionBits);
+}
+#else
+/**
+  */
 Ptr<Dictionary> getPredefinedDictionary(PREDEFINED_DICTIONARY_NAME name) {
-    switch(name) {
-
-    case DICT_ARUCO_ORIGINAL:
-        return makePtr<Dictionary>(DICT_ARUCO_DATA);
-
-    case DICT_4X4_50:
-        return makePtr<Dictionary>(DICT_4X4_50_DATA);
-    case DICT_4X4_100:
-        return makePtr<Dictionary>(DICT_4X4_100_DATA);
-    case DICT_4X4_250:
-        return makePtr<Dictionary>(DICT_4X4_250_DATA);
-    case DICT_4X4_1000:
-        return makePtr<Dictionary>(DICT_4X4_1000_DATA);
-
-    case DICT_5X5_50:
-        return makePtr<Dictionary>(DICT_5X5_50_DATA);
-    case DICT_5X5_100:
-        return makePtr<Dictionary>(DICT_5X5_100_DATA);
-    case DICT_5X5_250:
-        return makePtr<Dictionary>(DICT_5X5_250_DATA);
-    case DICT_5X5_1000:
-        return makePtr<Dictionary>(DICT_5X5_1000_DATA);
-
-    case DICT_6X6_50:
-        return makePtr<Dictionary>(DICT_6X6_50_DATA);
-    case DICT_6X6_100:
-        return makePtr<Dictionary>(DICT_6X6_100_DATA);
-    case DICT_6X6_250:
-        return makePtr<Dictionary>(DICT_6X6_250_DATA);
-    case DICT_6X6_1000:
-        return makePtr<Dictionary>(DICT_6X6_1000_DATA);
-
-    case DICT_7X7_50:
-        return makePtr<Dictionary>(DICT_7X7_50_DATA);
-    case DICT_7X7_100:
-        return makePtr<Dictionary>(DICT_7X7_100_DATA);
-    case DICT_7X7_250:
-        return makePtr<Dictionary>(DICT_7X7_250_DATA);
-    case DICT_7X7_1000:
-        return makePtr<Dictionary>(DICT_7X7_1000_DATA);
-
-    }
-    return makePtr<Dictionary>(DICT_4X4_50_DATA);
+    CV_Error(cv::Error::StsNotImplemented,
+             "Predefined dictionaries are not compiled in, use loadDictionary instead");
+    return Ptr<Dictionary>();
 }
+#endif
 
 
+/**
+  */
 Ptr<Dictionary> getPredefinedDictionary(int dict) {
     return getPredefinedDictionary(PREDEFINED_DICTIONARY_NAME(dict));
 }
 
 
+static const char DICTIONARY_FILE_MAGIC[4] = { 'A', 'R', 'U', 'D' };
+static const unsigned DICTIONARY_FILE_VERSION = 1;
+static const int DICTIONARY_FILE_HEADER_FIELDS = 8;
+static const size_t DICTIONARY_FILE_HEADER_SIZE = 4 * DICTIONARY_FILE_HEADER_FIELDS;
+
+
+/**
+  * @brief Memory mapped dictionary file, unmapped when the last dictionary using it is released
+  */
+struct DictionaryStorage {
+    void *data;
+    size_t size;
+
+    DictionaryStorage(void *_data, size_t _size) : data(_data), size(_size) {}
+
+    ~DictionaryStorage() {
+#ifdef ARUCO_HAVE_MMAP
+        munmap(data, size);
+#endif
+    }
+
+    private:
+    DictionaryStorage(const DictionaryStorage &);
+    DictionaryStorage &operator=(const DictionaryStorage &);
+};
+
+
+/**
+  * @brief Header fields are stored as little endian 32 bit integers, independently of the
+  * platform
+  */
+static void _writeHeaderField(uchar *field, unsigned value) {
+    for(int b = 0; b < 4; b++)
+        field[b] = (uchar)((value >> (8 * b)) & 0xff);
+}
+
+static unsigned _readHeaderField(const uchar *field) {
+    unsigned value = 0;
+    for(int b = 0; b < 4; b++)
+        value |= (unsigned)field[b] << (8 * b);
+    return value;
+}
+
+
+/**
+  * @brief Checks the header of a dictionary file of fileSize bytes, and returns the dictionary
+  * parameters and the offset of bytesList
+  */
+static void _parseDictionaryHeader(const uchar *header, size_t fileSize, int &markerSize,
+                                   int &nMarkers, int &maxCorrectionBits, size_t &offset) {
+
+    if(fileSize < DICTIONARY_FILE_HEADER_SIZE ||
+       memcmp(header, DICTIONARY_FILE_MAGIC, sizeof(DICTIONARY_FILE_MAGIC)) != 0)
+        CV_Error(cv::Error::StsParseError, "Not a dictionary file");
+
+    if(_readHeaderField(header + 4) != DICTIONARY_FILE_VERSION)
+        CV_Error(cv::Error::StsParseError, "Unsupported dictionary file version");
+
+    unsigned size = _readHeaderField(header + 8);
+    unsigned markers = _readHeaderField(header + 12);
+    unsigned correction = _readHeaderField(header + 16);
+    unsigned bytesPerMarker = _readHeaderField(header + 20);
+    unsigned dataOffset = _readHeaderField(header + 24);
+
+    if(size == 0 || size > 64 || markers == 0 || correction > size * size ||
+       bytesPerMarker != 4 * ((size * size + 8 - 1) / 8) ||
+       dataOffset < DICTIONARY_FILE_HEADER_SIZE || dataOffset > fileSize ||
+       (fileSize - dataOffset) / bytesPerMarker < markers)
+        CV_Error(cv::Error::StsParseError, "Corrupted dictionary file");
+
+    markerSize = (int)size;
+    nMarkers = (int)markers;
+    maxCorrectionBits = (int)correction;
+    offset = dataOffset;
+}
+
+
+/**
+  */
+void saveDictionary(const String &filename, const Ptr<Dictionary> &dictionary) {
+
+    CV_Assert(!dictionary.empty() && dictionary->markerSize > 0 &&
+              dictionary->bytesList.rows > 0);
+
+    int nbytes = (dictionary->markerSize * dictionary->markerSize + 8 - 1) / 8;
+    const Mat &bytesList = dictionary->bytesList;
+    CV_Assert(bytesList.cols * (int)bytesList.elemSize() == 4 * nbytes);
+
+    uchar header[DICTIONARY_FILE_HEADER_SIZE];
+    memcpy(header, DICTIONARY_FILE_MAGIC, sizeof(DICTIONARY_FILE_MAGIC));
+    _writeHeaderField(header + 4, DICTIONARY_FILE_VERSION);
+    _writeHeaderField(header + 8, (unsigned)dictionary->markerSize);
+    _writeHeaderField(header + 12, (unsigned)bytesList.rows);
+    _writeHeaderField(header + 16, (unsigned)max(dictionary->maxCorrectionBits, 0));
+    _writeHeaderField(header + 20, (unsigned)(4 * nbytes));
+    _writeHeaderField(header + 24, (unsigned)DICTIONARY_FILE_HEADER_SIZE);
+    _writeHeaderField(header + 28, 0);
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    if(!file) CV_Error(cv::Error::StsError, "Can not open the dictionary file for writing");
+
+    bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    for(int i = 0; i < bytesList.rows && ok; i++)
+        ok = fwrite(bytesList.ptr(i), 1, (size_t)(4 * nbytes), file) == (size_t)(4 * nbytes);
+    ok = (fclose(file) == 0) && ok;
+
+    if(!ok) CV_Error(cv::Error::StsError, "Error writing the dictionary file");
+}
+
+
+/**
+  */
+Ptr<Dictionary> loadDictionary(const String &filename) {
+
+    int markerSize, nMarkers, maxCorrectionBits;
+    size_t offset;
+
+#ifdef ARUCO_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) CV_Error(cv::Error::StsError, "Can not open the dictionary file");
+
+    struct stat fileStat;
+    void *data = MAP_FAILED;
+    size_t fileSize = 0;
+    if(fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+        fileSize = (size_t)fileStat.st_size;
+        data = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // the mapping stays valid after closing the file
+    close(fd);
+    if(data == MAP_FAILED) CV_Error(cv::Error::StsError, "Can not map the dictionary file");
+
+    Ptr<DictionaryStorage> storage = makePtr<DictionaryStorage>(data, fileSize);
+    _parseDictionaryHeader((const uchar *)data, fileSize, markerSize, nMarkers,
+                           maxCorrectionBits, offset);
+
+    int nbytes = (markerSize * markerSize + 8 - 1) / 8;
+    Mat bytesList(nMarkers, nbytes, CV_8UC4, (uchar *)data + offset);
+    Ptr<Dictionary> dictionary = makePtr<Dictionary>(bytesList, markerSize, maxCorrectionBits);
+    dictionary->storage = storage;
+    return dictionary;
+#else
+    // without memory mapping, bytesList is read into memory
+    FILE *file = fopen(filename.c_str(), "rb");
+    if(!file) CV_Error(cv::Error::StsError, "Can not open the dictionary file");
+
+    uchar header[DICTIONARY_FILE_HEADER_SIZE];
+    size_t fileSize = 0;
+    if(fseek(file, 0, SEEK_END) == 0) fileSize = (size_t)max(ftell(file), 0L);
+    bool ok = fseek(file, 0, SEEK_SET) == 0 &&
+              fread(header, 1, sizeof(header), file) == sizeof(header);
+    if(!ok) {
+        fclose(file);
+        CV_Error(cv::Error::StsParseError, "Not a dictionary file");
+    }
+
+    try {
+        _parseDictionaryHeader(header, fileSize, markerSize, nMarkers, maxCorrectionBits,
+                               offset);
+    } catch(...) {
+        fclose(file);
+        throw;
+    }
+
+    int nbytes = (markerSize * markerSize + 8 - 1) / 8;
+    Mat bytesList(nMarkers, nbytes, CV_8UC4);
+    ok = fseek(file, (long)offset, SEEK_SET) == 0 &&
+         fread(bytesList.ptr(), 1, bytesList.total() * bytesList.elemSize(), file) ==
+             bytesList.total() * bytesList.elemSize();
+    fclose(file);
+    if(!ok) CV_Error(cv::Error::StsError, "Error reading the dictionary file");
+
+    return makePtr<Dictionary>(bytesList, markerSize, maxCorrectionBits);
+#endif
+}
+
+
 /**
  * @brief Generates a random marker Mat of size markerSize x markerSize
  */
-static Mat _generateRandomMarker(int markerSize) {
+static Mat _generateRandomMarker(int markerSize, RNG &rng) {
     Mat marker(markerSize, markerSize, CV_8UC1, Scalar::all(0));
     for(int i = 0; i < markerSize; i++) {
         for(int j = 0; j < markerSize; j++) {
-            unsigned char bit = (unsigned char) (rand() % 2);
+            unsigned char bit = (unsigned char) (rng.next() % 2);
             marker.at< unsigned char >(i, j) = bit;
         }
     }
@@ -374,48 +643,159 @@ static int _getSelfDistance(const Mat &marker) {
     return minHamming;
 }
 
+
 /**
- */
-Ptr<Dictionary> generateCustomDictionary(int nMarkers, int markerSize,
-                                         Ptr<Dictionary> &baseDictionary) {
+  * Markers up to this size are generated as 64 bit words, bigger markers use the generic
+  * (sequential) generator
+  */
+static const int MAX_PACKED_MARKER_SIZE = 8;
 
-    Ptr<Dictionary> out = makePtr<Dictionary>();
-    out->markerSize = markerSize;
+/**
+  * Each generation round evaluates GENERATION_UNITS x CANDIDATES_PER_UNIT random markers in
+  * parallel. These values do not depend on the number of threads so the result only depends on
+  * the random seed
+  */
+static const int GENERATION_UNITS = 64;
+static const int CANDIDATES_PER_UNIT = 64;
 
-    // theoretical maximum intermarker distance
-    // See S. Garrido-Jurado, R. Muñoz-Salinas, F. J. Madrid-Cuevas, and M. J. Marín-Jiménez. 2014.
-    // "Automatic generation and detection of highly reliable fiducial markers under occlusion".
-    // Pattern Recogn. 47, 6 (June 2014), 2280-2292. DOI=10.1016/j.patcog.2014.01.005
-    int C = (int)std::floor(float(markerSize * markerSize) / 4.f);
-    int tau = 2 * (int)std::floor(float(C) * 4.f / 3.f);
+// after these number of unproductive iterations, the best option is accepted
+static const int MAX_UNPRODUCTIVE_ITERATIONS = 5000;
 
-    // if baseDictionary is provided, calculate its intermarker distance
-    if(baseDictionary->bytesList.rows > 0) {
-        CV_Assert(baseDictionary->markerSize == markerSize);
-        out->bytesList = baseDictionary->bytesList.clone();
 
-        int minDistance = markerSize * markerSize + 1;
-        for(int i = 0; i < out->bytesList.rows; i++) {
-            Mat markerBytes = out->bytesList.rowRange(i, i + 1);
-            Mat markerBits = Dictionary::getBitsFromByteList(markerBytes, markerSize);
-            minDistance = min(minDistance, _getSelfDistance(markerBits));
-            for(int j = i + 1; j < out->bytesList.rows; j++) {
-                minDistance = min(minDistance, out->getDistanceToId(markerBits, j));
+/**
+  * @brief Number of bits set in a 64 bit word, counted in parallel on groups of bits so it does
+  * not depend on a hardware population count instruction
+  */
+static inline int _popCount64(uint64 v) {
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((v * 0x0101010101010101ULL) >> 56);
+}
+
+
+/**
+  * @brief Marker code with bit k equal to the k-th cell (row-major order) of the marker, and
+  * its 4 rotations
+  */
+struct PackedMarker {
+    uint64 rotations[4];
+
+    void build(uint64 code, const RotationTable &table) {
+        for(int r = 0; r < 4; r++) {
+            const int *rotCells = &table.cells[r * table.nbits];
+            uint64 rot = 0;
+            for(int k = 0; k < table.nbits; k++)
+                rot |= ((code >> rotCells[k]) & 1) << k;
+            rotations[r] = rot;
+        }
+    }
+
+    int getSelfDistance() const {
+        int minHamming = 64 + 1;
+        for(int r = 1; r < 4; r++)
+            minHamming = min(minHamming, _popCount64(rotations[0] ^ rotations[r]));
+        return minHamming;
+    }
+
+    /**
+      * @brief Distance to the other marker in its best rotation, the same than
+      * Dictionary::getDistanceToId
+      */
+    int getDistance(const PackedMarker &other) const {
+        int minHamming = 64 + 1;
+        for(int r = 0; r < 4; r++)
+            minHamming = min(minHamming, _popCount64(rotations[0] ^ other.rotations[r]));
+        return minHamming;
+    }
+
+    static uint64 fromBits(const Mat &bits) {
+        uint64 code = 0;
+        for(int row = 0, k = 0; row < bits.rows; row++)
+            for(int col = 0; col < bits.cols; col++, k++)
+                if(bits.at< uchar >(row, col) != 0) code |= (uint64)1 << k;
+        return code;
+    }
+
+    static Mat toBits(uint64 code, int markerSize) {
+        Mat bits(markerSize, markerSize, CV_8UC1);
+        for(int row = 0, k = 0; row < markerSize; row++)
+            for(int col = 0; col < markerSize; col++, k++)
+                bits.at< uchar >(row, col) = (uchar)((code >> k) & 1);
+        return bits;
+    }
+};
+
+
+/**
+  * @brief Random candidate of a generation round and its distance to the markers accepted
+  * before the round
+  */
+struct GeneratedCandidate {
+    PackedMarker marker;
+    int minDistance;
+};
+
+
+/**
+ * ParallelLoopBody class for the parallelization of the candidate generation.
+ * Each work unit has its own random generator, seeded from the random seed, the round and the
+ * unit index.
+ */
+class GenerateCandidatesParallel : public ParallelLoopBody {
+    public:
+    GenerateCandidatesParallel(const RotationTable *_table, const vector< PackedMarker > *_accepted,
+                               vector< GeneratedCandidate > *_candidates, uint64 _seed, int _round)
+        : table(_table), accepted(_accepted), candidates(_candidates), seed(_seed), round(_round) {}
+
+    void operator()(const Range &range) const {
+        const int begin = range.start;
+        const int end = range.end;
+
+        const uint64 mask = table->nbits == 64 ? ~(uint64)0 : ((uint64)1 << table->nbits) - 1;
+
+        for(int u = begin; u < end; u++) {
+            RNG rng(seed + (uint64)round * GENERATION_UNITS + (uint64)u + 1);
+            for(int c = 0; c < CANDIDATES_PER_UNIT; c++) {
+                GeneratedCandidate &candidate = (*candidates)[u * CANDIDATES_PER_UNIT + c];
+                uint64 code = (((uint64)rng.next() << 32) | (uint64)rng.next()) & mask;
+                candidate.marker.build(code, *table);
+
+                int minDistance = candidate.marker.getSelfDistance();
+                for(size_t i = 0; i < accepted->size() && minDistance > 0; i++)
+                    minDistance = min(minDistance, candidate.marker.getDistance((*accepted)[i]));
+                candidate.minDistance = minDistance;
             }
         }
-        tau = minDistance;
     }
 
+    private:
+    GenerateCandidatesParallel &operator=(const GenerateCandidatesParallel &); // to quiet MSVC
+
+    const RotationTable *table;
+    const vector< PackedMarker > *accepted;
+    vector< GeneratedCandidate > *candidates;
+    uint64 seed;
+    int round;
+};
+
+
+/**
+ * @brief Generic generator, used for markers bigger than MAX_PACKED_MARKER_SIZE
+ */
+static void _generateCustomDictionaryGeneric(Ptr<Dictionary> &out, int nMarkers, int tau,
+                                             RNG &rng) {
+
+    int markerSize = out->markerSize;
+
     // current best option
     int bestTau = 0;
     Mat bestMarker;
 
-    // after these number of unproductive iterations, the best option is accepted
-    const int maxUnproductiveIterations = 5000;
     int unproductiveIterations = 0;
 
     while(out->bytesList.rows < nMarkers) {
-        Mat currentMarker = _generateRandomMarker(markerSize);
+        Mat currentMarker = _generateRandomMarker(markerSize, rng);
 
         int selfDistance = _getSelfDistance(currentMarker);
         int minDistance = selfDistance;
@@ -448,7 +828,7 @@ Ptr<Dictionary> generateCustomDictionary(int nMarkers, int markerSize,
             }
 
             // if number of unproductive iterarions has been reached, accept the current best option
-            if(unproductiveIterations == maxUnproductiveIterations) {
+            if(unproductiveIterations == MAX_UNPRODUCTIVE_ITERATIONS) {
                 unproductiveIterations = 0;
                 tau = bestTau;
                 bestTau = 0;
@@ -460,6 +840,145 @@ Ptr<Dictionary> generateCustomDictionary(int nMarkers, int markerSize,
 
     // update the maximum number of correction bits for the generated dictionary
     out->maxCorrectionBits = (tau - 1) / 2;
+}
+
+
+/**
+ * @brief Generator for markers that fit in a 64 bit word
+ *
+ * The random candidates are generated and compared with the accepted markers in parallel. Then
+ * they are processed in order with the same acceptance rules than the generic generator, only
+ * comparing them with the markers accepted during the current round.
+ */
+static void _generateCustomDictionaryPacked(Ptr<Dictionary> &out, int nMarkers, int tau,
+                                            int randomSeed) {
+
+    int markerSize = out->markerSize;
+    RotationTable table;
+    table.build(markerSize);
+
+    vector< PackedMarker > accepted(out->bytesList.rows);
+    for(int i = 0; i < out->bytesList.rows; i++) {
+        Mat markerBits = Dictionary::getBitsFromByteList(out->bytesList.rowRange(i, i + 1),
+                                                         markerSize);
+        accepted[i].build(PackedMarker::fromBits(markerBits), table);
+    }
+
+    const uint64 seed = (uint64)(unsigned)randomSeed << 32;
+    vector< GeneratedCandidate > candidates(GENERATION_UNITS * CANDIDATES_PER_UNIT);
+
+    // current best option
+    int bestTau = 0;
+    PackedMarker bestMarker = PackedMarker();
+
+    int unproductiveIterations = 0;
+
+    for(int round = 0; (int)accepted.size() < nMarkers; round++) {
+        size_t roundStart = accepted.size();
+        parallel_for_(Range(0, GENERATION_UNITS),
+                      GenerateCandidatesParallel(&table, &accepted, &candidates, seed, round));
+
+        for(size_t c = 0; c < candidates.size() && (int)accepted.size() < nMarkers; c++) {
+            const PackedMarker &currentMarker = candidates[c].marker;
+            int minDistance = candidates[c].minDistance;
+
+            // distance to the markers accepted in this round
+            if(minDistance >= bestTau) {
+                for(size_t i = roundStart; i < accepted.size(); i++) {
+                    minDistance = min(minDistance, currentMarker.getDistance(accepted[i]));
+                    if(minDistance <= bestTau) break;
+                }
+            }
+
+            // if distance is high enough, accept the marker
+            if(minDistance >= tau) {
+                unproductiveIterations = 0;
+                bestTau = 0;
+                accepted.push_back(currentMarker);
+            } else {
+                unproductiveIterations++;
+
+                // if distance is not enough, but is better than the current best option
+                if(minDistance > bestTau) {
+                    bestTau = minDistance;
+                    bestMarker = currentMarker;
+                }
+
+                // if number of unproductive iterarions has been reached, accept the current best
+                // option. It is only assigned once a candidate is at distance 1 or more from all
+                // the accepted markers, without it every candidate repeats an accepted marker
+                if(unproductiveIterations == MAX_UNPRODUCTIVE_ITERATIONS) {
+                    if(bestTau == 0)
+                        CV_Error(cv::Error::StsError,
+                                 "No more different markers of this size can be generated");
+                    unproductiveIterations = 0;
+                    tau = bestTau;
+                    bestTau = 0;
+                    accepted.push_back(bestMarker);
+                }
+            }
+        }
+    }
+
+    int nbytes = (markerSize * markerSize + 8 - 1) / 8;
+    int nbase = out->bytesList.rows;
+    Mat bytesList((int)accepted.size(), nbytes, CV_8UC4);
+    if(nbase > 0) out->bytesList.copyTo(bytesList.rowRange(0, nbase));
+    for(int i = nbase; i < (int)accepted.size(); i++) {
+        Mat bytes = Dictionary::getByteListFromBits(
+            PackedMarker::toBits(accepted[i].rotations[0], markerSize));
+        bytes.copyTo(bytesList.rowRange(i, i + 1));
+    }
+    out->bytesList = bytesList;
+
+    // update the maximum number of correction bits for the generated dictionary
+    out->maxCorrectionBits = (tau - 1) / 2;
+}
+
+
+/**
+ */
+Ptr<Dictionary> generateCustomDictionary(int nMarkers, int markerSize,
+                                         Ptr<Dictionary> &baseDictionary, int randomSeed) {
+
+    Ptr<Dictionary> out = makePtr<Dictionary>();
+    out->markerSize = markerSize;
+
+    // theoretical maximum intermarker distance
+    // See S. Garrido-Jurado, R. Muñoz-Salinas, F. J. Madrid-Cuevas, and M. J. Marín-Jiménez. 2014.
+    // "Automatic generation and detection of highly reliable fiducial markers under occlusion".
+    // Pattern Recogn. 47, 6 (June 2014), 2280-2292. DOI=10.1016/j.patcog.2014.01.005
+    int C = (int)std::floor(float(markerSize * markerSize) / 4.f);
+    int tau = 2 * (int)std::floor(float(C) * 4.f / 3.f);
+
+    // if baseDictionary is provided, calculate its intermarker distance
+    if(baseDictionary->bytesList.rows > 0) {
+        CV_Assert(baseDictionary->markerSize == markerSize);
+        out->bytesList = baseDictionary->bytesList.clone();
+
+        int minDistance = markerSize * markerSize + 1;
+        for(int i = 0; i < out->bytesList.rows; i++) {
+            Mat markerBytes = out->bytesList.rowRange(i, i + 1);
+            Mat markerBits = Dictionary::getBitsFromByteList(markerBytes, markerSize);
+            minDistance = min(minDistance, _getSelfDistance(markerBits));
+            for(int j = i + 1; j < out->bytesList.rows; j++) {
+                minDistance = min(minDistance, out->getDistanceToId(markerBits, j));
+            }
+        }
+        tau = minDistance;
+    }
+
+    if(out->bytesList.rows >= nMarkers) {
+        out->maxCorrectionBits = (tau - 1) / 2;
+        return out;
+    }
+
+    if(markerSize <= MAX_PACKED_MARKER_SIZE)
+        _generateCustomDictionaryPacked(out, nMarkers, tau, randomSeed);
+    else {
+        RNG rng((uint64)(unsigned)randomSeed << 32 | 1);
+        _generateCustomDictionaryGeneric(out, nMarkers, tau, rng);
+    }
 
     return out;
 }
@@ -48,6 +48,10 @@ namespace aruco {
 //! @{
 
 
+struct MarkerKernels;
+struct DictionaryStorage;
+
+
 /**
  * @brief Dictionary/Set of markers. It contains the inner codification
  *
@@ -65,6 +69,13 @@ class CV_EXPORTS_W Dictionary {
     CV_PROP_RW int markerSize;        // number of bits per dimension
     CV_PROP_RW int maxCorrectionBits; // maximum number of bits that can be corrected
 
+    // memory that bytesList points to when the dictionary is loaded from a file (@sa
+    // loadDictionary), empty otherwise
+    Ptr<DictionaryStorage> storage;
+
+    // sorted ids considered by identify, all the markers in bytesList if empty (@sa createView)
+    std::vector< int > allowedIds;
+
 
     /**
       */
@@ -98,6 +109,27 @@ class CV_EXPORTS_W Dictionary {
      */
     CV_WRAP static Ptr<Dictionary> get(int dict);
 
+    /**
+     * @brief Returns a view of the dictionary restricted to the given ids
+     *
+     * The view shares bytesList with the base dictionary and keeps the marker ids, only the
+     * identification is restricted: markers not in ids are never returned and are not compared
+     * with the candidates. Ids out of the base dictionary are ignored.
+     */
+    static Ptr<Dictionary> createView(const Ptr<Dictionary> &baseDictionary,
+                                      const std::vector< int > &ids);
+
+    /**
+     * @brief Returns a view of the dictionary restricted to the ids in [firstId, lastId)
+     */
+    static Ptr<Dictionary> createView(const Ptr<Dictionary> &baseDictionary, int firstId,
+                                      int lastId);
+
+    /**
+     * @brief Returns whether the id is a marker of the dictionary that identify can return
+     */
+    bool isAllowedId(int id) const;
+
     /**
      * @brief Given a matrix of bits. Returns whether if marker is identified or not.
      * It returns by reference the correct id (if any) and the correct rotation
@@ -111,6 +143,21 @@ class CV_EXPORTS_W Dictionary {
     int getDistanceToId(InputArray bits, int id, bool allRotations = true) const;
 
 
+    /**
+      * @brief Returns the minimum distance of the input bits to the specific id considering the
+      * four rotations, and by reference the rotation where it is reached (same convention than
+      * the rotation returned by identify)
+      */
+    int getDistanceAndRotationToId(InputArray bits, int id, int &rotation) const;
+
+
+    /**
+     * @brief Returns the identification kernels specialized for the markerSize of this dictionary
+     * and the given border width (@sa getMarkerKernels)
+     */
+    const MarkerKernels &getKernels(int borderBits = 1) const;
+
+
     /**
      * @brief Draw a canonical marker image
      */
@@ -119,6 +166,7 @@ class CV_EXPORTS_W Dictionary {
 
     /**
       * @brief Transform matrix of bits to list of bytes in the 4 rotations
+      * Rotations are built from precomputed bit permutation tables for each markerSize
       */
     static Mat getByteListFromBits(const Mat &bits);
 
@@ -161,6 +209,14 @@ enum CV_EXPORTS_W_SIMPLE PREDEFINED_DICTIONARY_NAME {
 
 /**
   * @brief Returns one of the predefined dictionaries defined in PREDEFINED_DICTIONARY_NAME
+  *
+  * Each call returns a new dictionary, but its bytesList points to constant data shared by all
+  * of them, so the codes must not be modified. Dictionary(const Ptr<Dictionary> &) clones
+  * bytesList into a modifiable dictionary.
+  *
+  * If the library is built with ARUCO_NO_PREDEFINED_DICTIONARIES, the predefined tables are
+  * not compiled in and this function throws. The dictionaries can then be loaded from files
+  * generated with the dictionary_tool (@sa loadDictionary).
   */
 CV_EXPORTS Ptr<Dictionary> getPredefinedDictionary(PREDEFINED_DICTIONARY_NAME name);
 
@@ -171,6 +227,35 @@ CV_EXPORTS Ptr<Dictionary> getPredefinedDictionary(PREDEFINED_DICTIONARY_NAME na
 CV_EXPORTS_W Ptr<Dictionary> getPredefinedDictionary(int dict);
 
 
+/**
+  * @brief Saves a dictionary in the binary dictionary format
+  *
+  * The file has a header of eight 32 bit little endian fields followed by bytesList:
+  * - magic number "ARUD"
+  * - format version, currently 1
+  * - markerSize
+  * - number of markers
+  * - maxCorrectionBits
+  * - bytes per marker, 4*nbytes (all the rotations)
+  * - offset of bytesList from the beginning of the file
+  * - reserved, 0
+  *
+  * bytesList is stored with its memory layout, one row per marker, so the file can be used
+  * in place (@sa loadDictionary). The allowed ids of a view are not saved, only its bytesList.
+  */
+CV_EXPORTS_W void saveDictionary(const String &filename, const Ptr<Dictionary> &dictionary);
+
+
+/**
+  * @brief Loads a dictionary saved with saveDictionary
+  *
+  * The file is memory mapped and bytesList points directly to it, nothing is parsed or copied.
+  * The mapping is released with the last copy of the dictionary. As for the predefined
+  * dictionaries, bytesList must not be modified.
+  */
+CV_EXPORTS_W Ptr<Dictionary> loadDictionary(const String &filename);
+
+
 /**
   * @see generateCustomDictionary
   */
@@ -190,11 +275,18 @@ CV_EXPORTS_AS(custom_dictionary) Ptr<Dictionary> generateCustomDictionary(
   * by markerSize x markerSize bits. If baseDictionary is provided, its markers are directly
   * included and the rest are generated based on them. If the size of baseDictionary is higher
   * than nMarkers, only the first nMarkers in baseDictionary are taken and no new marker is added.
+  *
+  * @param randomSeed seed of the random generators. The generated dictionary only depends on
+  * this seed, not on the number of threads
+  *
+  * For markers up to 8x8 bits, the random candidates are evaluated in parallel using 64 bit
+  * words.
   */
 CV_EXPORTS_AS(custom_dictionary_from) Ptr<Dictionary> generateCustomDictionary(
         int nMarkers,
         int markerSize,
-        Ptr<Dictionary> &baseDictionary);
+        Ptr<Dictionary> &baseDictionary,
+        int randomSeed = 0);
 
 
 
@@ -0,0 +1,92 @@
+#ifndef CARDBOARDKEYBOARD_FRAME_QUEUE_HPP
+#define CARDBOARDKEYBOARD_FRAME_QUEUE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Lock-free queue between exactly one producer thread and one consumer thread.
+// The N slots are allocated once and reused: the producer fills the slot returned by beginPush()
+// in place, so a Mat or vector in a slot keeps its buffer from one frame to the next.
+template<typename T, size_t N>
+class FrameQueue {
+public:
+    FrameQueue() : head(0), tail(0) {}
+
+    // Return the slot to fill by the producer, NULL if the queue is full.
+    T *beginPush() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) == N) return NULL;
+        return &slots[h % N];
+    }
+
+    // Publish the slot returned by beginPush() to the consumer.
+    void endPush() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Return the oldest slot for the consumer, NULL if the queue is empty.
+    T *front() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(t == head.load(std::memory_order_acquire)) return NULL;
+        return &slots[t % N];
+    }
+
+    // Give the slot returned by front() back to the producer.
+    void pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::array<T, N> slots;
+    // Number of slots pushed and popped since the creation, only written by producer and consumer.
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+// Single slot mailbox between one producer thread and one consumer thread, always holding the most
+// recent value. It is a triple buffer: the producer fills its back slot and swaps it with the
+// middle one, replacing a value not yet taken, and the consumer swaps its front slot with the
+// middle one when it holds a new value. As in FrameQueue the slots are reused in place.
+template<typename T>
+class FrameMailbox {
+public:
+    FrameMailbox() : middle(1), back(0), front(2) {}
+
+    // Return the slot to fill by the producer.
+    T *backSlot() {
+        return &slots[back];
+    }
+
+    // Publish the slot returned by backSlot(), dropping the previous value if it was not taken.
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    // Return true if a value was published since the last take().
+    bool hasNew() const {
+        return (middle.load(std::memory_order_relaxed) & FRESH) != 0;
+    }
+
+    // Return the most recent value for the consumer, NULL if nothing new was published. The slot
+    // stays owned by the consumer until the next take().
+    T *take() {
+        if(!hasNew()) return NULL;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return &slots[front];
+    }
+
+private:
+    static const int INDEX = 3;
+    static const int FRESH = 4;
+
+    std::array<T, 3> slots;
+    // Index of the middle slot, with FRESH set while it holds a value the consumer has not taken.
+    std::atomic<int> middle;
+    // Only used by the producer.
+    int back;
+    // Only used by the consumer.
+    int front;
+};
+
+#endif
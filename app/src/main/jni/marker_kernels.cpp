@@ -0,0 +1,308 @@
+/*
+By downloading, copying, installing or using the software you agree to this
+license. If you do not agree to this license, do not download, install,
+copy or use the software.
+
+                          License Agreement
+               For Open Source Computer Vision Library
+                       (3-clause BSD License)
+
+Copyright (C) 2013, OpenCV Foundation, all rights reserved.
+Third party copyrights are property of their respective owners.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+  * Neither the names of the copyright holders nor the names of the contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+This software is provided by the copyright holders and contributors "as is" and
+any express or implied warranties, including, but not limited to, the implied
+warranties of merchantability and fitness for a particular purpose are
+disclaimed. In no event shall copyright holders or contributors be liable for
+any direct, indirect, incidental, special, exemplary, or consequential damages
+(including, but not limited to, procurement of substitute goods or services;
+loss of use, data, or profits; or business interruption) however caused
+and on any theory of liability, whether in contract, strict liability,
+or tort (including negligence or otherwise) arising in any way out of
+the use of this software, even if advised of the possibility of such damage.
+*/
+
+#include "precomp.hpp"
+#include "marker_kernels.hpp"
+
+namespace cv {
+namespace aruco {
+
+using namespace std;
+
+
+/**
+  * @brief Number of bits set in each byte value
+  *
+  * armeabi-v7a has no population count instruction without NEON, __builtin_popcount would be a
+  * library call for every byte.
+  */
+static const uchar _popCountTable[256] = {
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
+};
+
+
+/**
+  * @brief Number of bits set in a byte
+  */
+static inline int _popCount(uchar v) {
+    return _popCountTable[v];
+}
+
+
+/**
+  * For all kernels, a template parameter equal to 0 means that the value is only known at
+  * runtime and is taken from the function arguments.
+  */
+template< int N_ >
+static void _packBitsKernel(const Mat &bits, int markerSize, uchar *bytes) {
+
+    const int N = N_ > 0 ? N_ : markerSize;
+    const int nbits = N * N;
+    const int nbytes = (nbits + 8 - 1) / 8;
+
+    for(int b = 0; b < nbytes; b++)
+        bytes[b] = 0;
+
+    for(int row = 0; row < N; row++) {
+        const uchar *bitsRow = bits.ptr< uchar >(row);
+        for(int col = 0; col < N; col++) {
+            const int k = row * N + col;
+            // the last byte is not complete if nbits is not multiple of 8
+            const int bitsInByte = min(8, nbits - 8 * (k / 8));
+            bytes[k / 8] |= (uchar)((bitsRow[col] != 0) << (bitsInByte - 1 - k % 8));
+        }
+    }
+}
+
+
+/**
+  * @brief Distance to the four rotations of each marker, stopping at the first marker within
+  * maxCorrection
+  */
+template< int N_ >
+static bool _identifyKernel(const Mat &bytesList, const int *ids, int nIds, const uchar *bytes,
+                            int markerSize, int maxCorrection, int &idx, int &rotation) {
+
+    const int N = N_ > 0 ? N_ : markerSize;
+    const int nbytes = (N * N + 8 - 1) / 8;
+    const int nMarkers = ids ? nIds : bytesList.rows;
+
+    idx = -1;
+    for(int i = 0; i < nMarkers; i++) {
+        const int m = ids ? ids[i] : i;
+        const uchar *code = bytesList.ptr(m);
+        int currentMinDistance = N * N + 1;
+        int currentRotation = -1;
+        for(int r = 0; r < 4; r++) {
+            int currentHamming = 0;
+            for(int b = 0; b < nbytes; b++)
+                currentHamming += _popCount(code[r * nbytes + b] ^ bytes[b]);
+
+            if(currentHamming < currentMinDistance) {
+                currentMinDistance = currentHamming;
+                currentRotation = r;
+            }
+        }
+
+        if(currentMinDistance <= maxCorrection) {
+            idx = m;
+            rotation = currentRotation;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+  * @brief Number of white bits in the border of a matrix of bits
+  */
+template< int N_, int B_ >
+static int _borderErrorsKernel(const Mat &bits, int markerSize, int borderSize) {
+
+    const int N = N_ > 0 ? N_ : markerSize;
+    const int B = B_ > 0 ? B_ : borderSize;
+    const int sizeWithBorders = N + 2 * B;
+
+    int totalErrors = 0;
+    for(int y = 0; y < sizeWithBorders; y++) {
+        const uchar *bitsRow = bits.ptr< uchar >(y);
+        if(y < B || y >= sizeWithBorders - B) {
+            // complete rows of the top and bottom borders
+            for(int x = 0; x < sizeWithBorders; x++)
+                totalErrors += bitsRow[x] != 0;
+        } else {
+            // left and right borders
+            for(int k = 0; k < B; k++) {
+                totalErrors += bitsRow[k] != 0;
+                totalErrors += bitsRow[sizeWithBorders - 1 - k] != 0;
+            }
+        }
+    }
+    return totalErrors;
+}
+
+
+/**
+  * @brief Value of the cell (x, y) of a marker image, 1 if more than half of its pixels are higher
+  * than threshold
+  */
+static inline uchar _cellValue(const Mat &img, int x, int y, int cellSize, int innerCellSize,
+                               int cellMarginPixels, int threshold) {
+
+    int nZ = 0;
+    for(int py = 0; py < innerCellSize; py++) {
+        const uchar *pixels = img.ptr< uchar >(y * cellSize + cellMarginPixels + py) +
+                              x * cellSize + cellMarginPixels;
+        for(int px = 0; px < innerCellSize; px++)
+            nZ += pixels[px] > threshold;
+    }
+    return nZ > innerCellSize * innerCellSize / 2 ? 1 : 0;
+}
+
+
+/**
+  * @brief Border cells are visited row by row, so that the early reject happens as soon as
+  * possible and the accesses to the image are sequential
+  */
+template< int N_, int B_ >
+static int _borderCellBitsKernel(const Mat &img, int markerSize, int borderSize, int cellSize,
+                                 int cellMarginPixels, int threshold, int maxErrors, Mat &bits) {
+
+    const int N = N_ > 0 ? N_ : markerSize;
+    const int B = B_ > 0 ? B_ : borderSize;
+    const int sizeWithBorders = N + 2 * B;
+    const int innerCellSize = cellSize - 2 * cellMarginPixels;
+
+    int totalErrors = 0;
+    for(int y = 0; y < sizeWithBorders; y++) {
+        uchar *bitsRow = bits.ptr< uchar >(y);
+        const bool completeRow = y < B || y >= sizeWithBorders - B;
+        for(int x = 0; x < sizeWithBorders; x++) {
+            // skip inner cells
+            if(!completeRow && x == B) x = sizeWithBorders - B;
+            bitsRow[x] =
+                _cellValue(img, x, y, cellSize, innerCellSize, cellMarginPixels, threshold);
+            totalErrors += bitsRow[x];
+            if(totalErrors > maxErrors) return totalErrors;
+        }
+    }
+    return totalErrors;
+}
+
+
+/**
+  * @brief Only called for the candidates whose border is valid
+  */
+template< int N_, int B_ >
+static void _innerCellBitsKernel(const Mat &img, int markerSize, int borderSize, int cellSize,
+                                 int cellMarginPixels, int threshold, Mat &bits) {
+
+    const int N = N_ > 0 ? N_ : markerSize;
+    const int B = B_ > 0 ? B_ : borderSize;
+    const int innerCellSize = cellSize - 2 * cellMarginPixels;
+
+    for(int y = B; y < N + B; y++) {
+        uchar *bitsRow = bits.ptr< uchar >(y);
+        for(int x = B; x < N + B; x++)
+            bitsRow[x] =
+                _cellValue(img, x, y, cellSize, innerCellSize, cellMarginPixels, threshold);
+    }
+}
+
+
+/**
+  * @brief Set of kernels instantiated for a marker size and border width
+  */
+template< int N, int B >
+static MarkerKernels _makeKernels() {
+    MarkerKernels kernels;
+    kernels.packBits = _packBitsKernel< N >;
+    kernels.identify = _identifyKernel< N >;
+    kernels.borderErrors = _borderErrorsKernel< N, B >;
+    kernels.borderCellBits = _borderCellBitsKernel< N, B >;
+    kernels.innerCellBits = _innerCellBitsKernel< N, B >;
+    return kernels;
+}
+
+
+// specialized marker sizes and border widths
+static const int MIN_SPECIALIZED_SIZE = 4;
+static const int MAX_SPECIALIZED_SIZE = 7;
+static const int MAX_SPECIALIZED_BORDER = 2;
+
+
+/**
+  * @brief Table of kernels, row i corresponds to marker size MIN_SPECIALIZED_SIZE + i and
+  * column j to border width j (0 means not specialized border)
+  */
+struct MarkerKernelsTable {
+    MarkerKernels specialized[MAX_SPECIALIZED_SIZE - MIN_SPECIALIZED_SIZE + 1]
+                             [MAX_SPECIALIZED_BORDER + 1];
+    MarkerKernels generic;
+
+    MarkerKernelsTable() {
+        specialized[0][0] = _makeKernels< 4, 0 >();
+        specialized[0][1] = _makeKernels< 4, 1 >();
+        specialized[0][2] = _makeKernels< 4, 2 >();
+        specialized[1][0] = _makeKernels< 5, 0 >();
+        specialized[1][1] = _makeKernels< 5, 1 >();
+        specialized[1][2] = _makeKernels< 5, 2 >();
+        specialized[2][0] = _makeKernels< 6, 0 >();
+        specialized[2][1] = _makeKernels< 6, 1 >();
+        specialized[2][2] = _makeKernels< 6, 2 >();
+        specialized[3][0] = _makeKernels< 7, 0 >();
+        specialized[3][1] = _makeKernels< 7, 1 >();
+        specialized[3][2] = _makeKernels< 7, 2 >();
+        generic = _makeKernels< 0, 0 >();
+    }
+};
+
+
+/**
+  */
+const MarkerKernels &getMarkerKernels(int markerSize, int borderSize) {
+
+    // thread safe initialization, done once
+    static const MarkerKernelsTable table;
+
+    if(markerSize < MIN_SPECIALIZED_SIZE || markerSize > MAX_SPECIALIZED_SIZE)
+        return table.generic;
+
+    int border = borderSize >= 1 && borderSize <= MAX_SPECIALIZED_BORDER ? borderSize : 0;
+    return table.specialized[markerSize - MIN_SPECIALIZED_SIZE][border];
+}
+
+
+}
+}
@@ -0,0 +1,113 @@
+/*
+By downloading, copying, installing or using the software you agree to this
+license. If you do not agree to this license, do not download, install,
+copy or use the software.
+
+                          License Agreement
+               For Open Source Computer Vision Library
+                       (3-clause BSD License)
+
+Copyright (C) 2013, OpenCV Foundation, all rights reserved.
+Third party copyrights are property of their respective owners.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+  * Neither the names of the copyright holders nor the names of the contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+This software is provided by the copyright holders and contributors "as is" and
+any express or implied warranties, including, but not limited to, the implied
+warranties of merchantability and fitness for a particular purpose are
+disclaimed. In no event shall copyright holders or contributors be liable for
+any direct, indirect, incidental, special, exemplary, or consequential damages
+(including, but not limited to, procurement of substitute goods or services;
+loss of use, data, or profits; or business interruption) however caused
+and on any theory of liability, whether in contract, strict liability,
+or tort (including negligence or otherwise) arising in any way out of
+the use of this software, even if advised of the possibility of such damage.
+*/
+
+#ifndef __OPENCV_ARUCO_MARKER_KERNELS_HPP__
+#define __OPENCV_ARUCO_MARKER_KERNELS_HPP__
+
+#include <opencv2/core.hpp>
+
+namespace cv {
+namespace aruco {
+
+//! @addtogroup aruco
+//! @{
+
+
+/**
+ * @brief Inner loops of the marker identification
+ *
+ * The marker size and the border width are runtime values, so the generic loops can not be
+ * unrolled. For the sizes of the predefined dictionaries (4 to 7 bits) and the usual border
+ * widths (1 and 2 bits), these functions are instantiated with both values known at compile
+ * time, so all the loops over bits and cells and all the bit masks are constant folded. Other
+ * sizes use the generic instantiation.
+ *
+ * Every function receives the runtime sizes, which are ignored by the specialized versions.
+ * The proper set of kernels is selected once with getMarkerKernels() (@sa Dictionary::getKernels).
+ */
+struct MarkerKernels {
+
+    /**
+     * @brief Pack the normal rotation of a markerSize x markerSize matrix of bits using the
+     * bytesList layout. bytes must have space for ceil(markerSize*markerSize/8.) bytes
+     */
+    void (*packBits)(const Mat &bits, int markerSize, uchar *bytes);
+
+    /**
+     * @brief Search the packed bits in the four rotations of the markers in bytesList, only the
+     * nIds rows in ids if ids is not null. Returns the first marker whose distance is not higher
+     * than maxCorrection, the same semantic than Dictionary::identify
+     */
+    bool (*identify)(const Mat &bytesList, const int *ids, int nIds, const uchar *bytes,
+                     int markerSize, int maxCorrection, int &idx, int &rotation);
+
+    /**
+     * @brief Number of erroneous (white) bits in the border of a matrix of bits including the
+     * border
+     */
+    int (*borderErrors)(const Mat &bits, int markerSize, int borderSize);
+
+    /**
+     * @brief Assign the border bits of a marker image without perspective and return the number
+     * of erroneous (white) bits. A bit is 1 if more than half of the pixels of its cell, ignoring
+     * cellMarginPixels on each side, are higher than threshold. The extraction stops as soon as
+     * the number of errors is higher than maxErrors, leaving the rest of the bits unassigned
+     */
+    int (*borderCellBits)(const Mat &img, int markerSize, int borderSize, int cellSize,
+                          int cellMarginPixels, int threshold, int maxErrors, Mat &bits);
+
+    /**
+     * @brief Assign the inner (code) bits of a marker image without perspective, with the same
+     * criterion than borderCellBits
+     */
+    void (*innerCellBits)(const Mat &img, int markerSize, int borderSize, int cellSize,
+                          int cellMarginPixels, int threshold, Mat &bits);
+};
+
+
+/**
+ * @brief Returns the kernels for the given marker size and border width
+ */
+CV_EXPORTS const MarkerKernels &getMarkerKernels(int markerSize, int borderSize);
+
+
+//! @}
+}
+}
+
+#endif
@@ -0,0 +1,146 @@
+/*
+By downloading, copying, installing or using the software you agree to this
+license. If you do not agree to this license, do not download, install,
+copy or use the software.
+
+                          License Agreement
+               For Open Source Computer Vision Library
+                       (3-clause BSD License)
+
+Copyright (C) 2013, OpenCV Foundation, all rights reserved.
+Third party copyrights are property of their respective owners.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+  * Neither the names of the copyright holders nor the names of the contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+This software is provided by the copyright holders and contributors "as is" and
+any express or implied warranties, including, but not limited to, the implied
+warranties of merchantability and fitness for a particular purpose are
+disclaimed. In no event shall copyright holders or contributors be liable for
+any direct, indirect, incidental, special, exemplary, or consequential damages
+(including, but not limited to, procurement of substitute goods or services;
+loss of use, data, or profits; or business interruption) however caused
+and on any theory of liability, whether in contract, strict liability,
+or tort (including negligence or otherwise) arising in any way out of
+the use of this software, even if advised of the possibility of such damage.
+*/
+
+/*
+ * Host benchmark of detectMarkers on synthetic frames with about 10, 100 and 1000 marker
+ * candidates, for each number of threads from 1 to the number of CPUs, doubling. It is not part of
+ * the Android build, compile it with the host OpenCV, e.g.
+ *
+ *   g++ -O2 -I.. detection_benchmark.cpp ../aruco.cpp ../dictionary.cpp ../marker_kernels.cpp \
+ *       `pkg-config --cflags --libs opencv` -o detection_benchmark
+ *
+ * Usage:
+ *   detection_benchmark [iterations per measure] [max threads]
+ */
+
+#include "aruco.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+using namespace cv::aruco;
+
+
+/**
+  * @brief Side of each marker and margin around it in the synthetic frames, in pixels
+  */
+static const int MARKER_SIDE = 36;
+static const int MARKER_MARGIN = 12;
+
+
+/**
+  * @brief Create a white frame with nMarkers different markers of the dictionary in a grid
+  */
+static Mat createFrame(Ptr<Dictionary> &dictionary, int nMarkers) {
+    int cell = MARKER_SIDE + 2 * MARKER_MARGIN;
+    int cols = 1;
+    while(cols * cols < nMarkers)
+        cols++;
+    int rows = (nMarkers + cols - 1) / cols;
+
+    Mat frame(rows * cell, cols * cell, CV_8UC1, Scalar::all(255));
+    Mat marker;
+    for(int i = 0; i < nMarkers; i++) {
+        drawMarker(dictionary, i, MARKER_SIDE, marker);
+        Rect roi((i % cols) * cell + MARKER_MARGIN, (i / cols) * cell + MARKER_MARGIN,
+                 MARKER_SIDE, MARKER_SIDE);
+        marker.copyTo(frame(roi));
+    }
+    return frame;
+}
+
+
+/**
+  * @brief Average time of detectMarkers on the frame, in milliseconds
+  */
+static double measure(const Mat &frame, Ptr<Dictionary> &dictionary,
+                      const Ptr<DetectorParameters> &parameters, int iterations, int &detected) {
+    vector< vector< Point2f > > corners;
+    vector< int > ids;
+
+    // first call out of the measure, to allocate the buffers
+    detectMarkers(frame, dictionary, corners, ids, parameters);
+
+    int64 start = getTickCount();
+    for(int i = 0; i < iterations; i++)
+        detectMarkers(frame, dictionary, corners, ids, parameters);
+    int64 end = getTickCount();
+
+    detected = (int)ids.size();
+    return (end - start) * 1000. / getTickFrequency() / iterations;
+}
+
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    int maxThreads = argc > 2 ? atoi(argv[2]) : getNumberOfCPUs();
+    if(iterations <= 0 || maxThreads <= 0) {
+        fprintf(stderr, "Usage: detection_benchmark [iterations per measure] [max threads]\n");
+        return 1;
+    }
+
+    static const int CANDIDATES[] = { 10, 100, 1000 };
+    static const int N_CANDIDATES = sizeof(CANDIDATES) / sizeof(CANDIDATES[0]);
+
+    Ptr<Dictionary> dictionary = getPredefinedDictionary(DICT_4X4_1000);
+    Ptr<DetectorParameters> parameters = DetectorParameters::create();
+
+    try {
+        printf("%10s %10s %10s %10s %10s\n", "candidates", "frame", "threads", "ms", "detected");
+        for(int c = 0; c < N_CANDIDATES; c++) {
+            Mat frame = createFrame(dictionary, CANDIDATES[c]);
+
+            for(int threads = 1; threads <= maxThreads; threads *= 2) {
+                setNumThreads(threads);
+                int detected = 0;
+                double ms = measure(frame, dictionary, parameters, iterations, detected);
+                printf("%10d %4dx%-5d %10d %10.2f %10d\n", CANDIDATES[c], frame.cols, frame.rows,
+                       threads, ms, detected);
+            }
+        }
+    } catch(const cv::Exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    // back to the default number of threads
+    setNumThreads(-1);
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+By downloading, copying, installing or using the software you agree to this
+license. If you do not agree to this license, do not download, install,
+copy or use the software.
+
+                          License Agreement
+               For Open Source Computer Vision Library
+                       (3-clause BSD License)
+
+Copyright (C) 2013, OpenCV Foundation, all rights reserved.
+Third party copyrights are property of their respective owners.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+
+  * Neither the names of the copyright holders nor the names of the contributors
+    may be used to endorse or promote products derived from this software
+    without specific prior written permission.
+
+This software is provided by the copyright holders and contributors "as is" and
+any express or implied warranties, including, but not limited to, the implied
+warranties of merchantability and fitness for a particular purpose are
+disclaimed. In no event shall copyright holders or contributors be liable for
+any direct, indirect, incidental, special, exemplary, or consequential damages
+(including, but not limited to, procurement of substitute goods or services;
+loss of use, data, or profits; or business interruption) however caused
+and on any theory of liability, whether in contract, strict liability,
+or tort (including negligence or otherwise) arising in any way out of
+the use of this software, even if advised of the possibility of such damage.
+*/
+
+/*
+ * Host tool to convert dictionaries to the binary dictionary format (@sa saveDictionary).
+ * It is not part of the Android build, compile it with the host OpenCV, e.g.
+ *
+ *   g++ -I.. dictionary_tool.cpp ../dictionary.cpp ../marker_kernels.cpp \
+ *       `pkg-config --cflags --libs opencv` -o dictionary_tool
+ *
+ * Usage:
+ *   dictionary_tool convert <DICT_NAME|all> <output directory>
+ *   dictionary_tool generate <number of markers> <marker size> <output file> [random seed]
+ *   dictionary_tool info <dictionary file>
+ */
+
+#include "dictionary.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+using namespace cv;
+using namespace cv::aruco;
+
+
+struct DictionaryName {
+    const char *name;
+    PREDEFINED_DICTIONARY_NAME dict;
+};
+
+static const DictionaryName DICTIONARY_NAMES[] = {
+    { "DICT_4X4_50", DICT_4X4_50 },     { "DICT_4X4_100", DICT_4X4_100 },
+    { "DICT_4X4_250", DICT_4X4_250 },   { "DICT_4X4_1000", DICT_4X4_1000 },
+    { "DICT_5X5_50", DICT_5X5_50 },     { "DICT_5X5_100", DICT_5X5_100 },
+    { "DICT_5X5_250", DICT_5X5_250 },   { "DICT_5X5_1000", DICT_5X5_1000 },
+    { "DICT_6X6_50", DICT_6X6_50 },     { "DICT_6X6_100", DICT_6X6_100 },
+    { "DICT_6X6_250", DICT_6X6_250 },   { "DICT_6X6_1000", DICT_6X6_1000 },
+    { "DICT_7X7_50", DICT_7X7_50 },     { "DICT_7X7_100", DICT_7X7_100 },
+    { "DICT_7X7_250", DICT_7X7_250 },   { "DICT_7X7_1000", DICT_7X7_1000 },
+    { "DICT_ARUCO_ORIGINAL", DICT_ARUCO_ORIGINAL }
+};
+
+static const int N_DICTIONARY_NAMES = sizeof(DICTIONARY_NAMES) / sizeof(DICTIONARY_NAMES[0]);
+
+
+static void printUsage() {
+    fprintf(stderr, "Usage:\n"
+                    "  dictionary_tool convert <DICT_NAME|all> <output directory>\n"
+                    "  dictionary_tool generate <number of markers> <marker size> "
+                    "<output file> [random seed]\n"
+                    "  dictionary_tool info <dictionary file>\n");
+}
+
+
+static int convert(const string &name, const string &outputDirectory) {
+    int converted = 0;
+    for(int i = 0; i < N_DICTIONARY_NAMES; i++) {
+        if(name != "all" && name != DICTIONARY_NAMES[i].name) continue;
+
+        string filename = outputDirectory + "/" + DICTIONARY_NAMES[i].name + ".dict";
+        saveDictionary(filename, getPredefinedDictionary(DICTIONARY_NAMES[i].dict));
+        printf("%s\n", filename.c_str());
+        converted++;
+    }
+
+    if(converted == 0) {
+        fprintf(stderr, "Unknown dictionary %s\n", name.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+
+static int generate(int nMarkers, int markerSize, const string &filename, int randomSeed) {
+    if(nMarkers <= 0 || markerSize <= 0) {
+        printUsage();
+        return 1;
+    }
+
+    Ptr<Dictionary> baseDictionary = makePtr<Dictionary>();
+    Ptr<Dictionary> dictionary =
+        generateCustomDictionary(nMarkers, markerSize, baseDictionary, randomSeed);
+    saveDictionary(filename, dictionary);
+    printf("%s: %d markers of %dx%d bits, %d correction bits\n", filename.c_str(),
+           dictionary->bytesList.rows, markerSize, markerSize, dictionary->maxCorrectionBits);
+    return 0;
+}
+
+
+static int info(const string &filename) {
+    Ptr<Dictionary> dictionary = loadDictionary(filename);
+    printf("%s: %d markers of %dx%d bits, %d correction bits\n", filename.c_str(),
+           dictionary->bytesList.rows, dictionary->markerSize, dictionary->markerSize,
+           dictionary->maxCorrectionBits);
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    if(argc < 3) {
+        printUsage();
+        return 1;
+    }
+
+    string command = argv[1];
+    try {
+        if(command == "convert" && argc == 4)
+            return convert(argv[2], argv[3]);
+        if(command == "generate" && (argc == 5 || argc == 6))
+            return generate(atoi(argv[2]), atoi(argv[3]), argv[4], argc == 6 ? atoi(argv[5]) : 0);
+        if(command == "info" && argc == 3)
+            return info(argv[2]);
+    } catch(const cv::Exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    printUsage();
+    return 1;
+}